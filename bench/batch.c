@@ -0,0 +1,90 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../smalloc.h"
+
+/*
+Batch allocation against one call per block.
+
+For every size and batch length, a batch of blocks is allocated and then freed
+again, repeatedly, once with smalloc_batch() and sfree_batch(), and once with
+malloc() and free() for each block. Blocks are freed in the order they were
+allocated. The time per block of both is reported.
+
+usage: bench-batch [blocks_per_size]
+*/
+
+#define MAX_BATCH (4096)
+
+static const size_t sizes[] = {16, 64, 256, 1024, 4096};
+static const size_t batches[] = {16, 256, MAX_BATCH};
+
+static void *ptrs[MAX_BATCH];
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double
+run_batch(size_t size, size_t n, size_t rounds)
+{
+	double start = now();
+	for (size_t r = 0; r < rounds; r++) {
+		if (smalloc_batch(size, n, ptrs) != n) {
+			fprintf(stderr, "smalloc_batch(%zu, %zu) failed\n", size, n);
+			exit(1);
+		}
+		sfree_batch(ptrs, n);
+	}
+	return now() - start;
+}
+
+static double
+run_single(size_t size, size_t n, size_t rounds)
+{
+	double start = now();
+	for (size_t r = 0; r < rounds; r++) {
+		for (size_t i = 0; i < n; i++) {
+			ptrs[i] = malloc(size);
+			if (ptrs[i] == NULL) {
+				fprintf(stderr, "malloc(%zu) failed\n", size);
+				exit(1);
+			}
+		}
+		for (size_t i = 0; i < n; i++) {
+			free(ptrs[i]);
+		}
+	}
+	return now() - start;
+}
+
+int
+main(int argc, char **argv)
+{
+	size_t blocks = argc > 1 ? strtoull(argv[1], NULL, 10) : 4000000;
+	if (blocks == 0) {
+		fprintf(stderr, "usage: bench-batch [blocks_per_size]\n");
+		return 1;
+	}
+
+	printf("%8s %8s %12s %12s %8s\n", "size", "batch", "batch_ns", "single_ns", "speedup");
+	for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		for (size_t b = 0; b < sizeof(batches) / sizeof(batches[0]); b++) {
+			size_t n = batches[b];
+			size_t rounds = blocks / n + 1;
+			// Warm up the heap, so that neither run pays for growing it.
+			run_single(sizes[s], n, 1);
+			double batch = run_batch(sizes[s], n, rounds);
+			double single = run_single(sizes[s], n, rounds);
+			printf("%8zu %8zu %12.1f %12.1f %8.2f\n", sizes[s], n,
+				batch * 1e9 / (rounds * n), single * 1e9 / (rounds * n), single / batch);
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,124 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/*
+Copy-on-write after fork.
+
+The parent fills the heap with live_mb MiB of blocks of random size up to
+max_size, writes to all of them, and frees every fourth. It then forks. The
+child frees free_pct percent of the remaining blocks at random and allocates as
+many new ones without writing to them, so that every page the child copies is
+copied because the allocator wrote to it. Caches that link free blocks through
+their payload write to every page a block is freed into, so make bench-fork
+runs smalloc as built by default and without the thread cache, the -notcache
+builds. The pages the child copies are counted with its page faults, after the
+frees and after the mallocs. Private dirty memory in /proc/self/smaps is no
+good for this, since kernels may estimate how many processes map a large folio.
+
+usage: bench-fork [live_mb] [max_size] [free_pct]
+*/
+
+#define MIN_SIZE (16)
+
+static uint64_t
+rng(uint64_t *state)
+{
+	// https://en.wikipedia.org/wiki/Xorshift#xorshift*
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return *state * 0x2545F4914F6CDD1DULL;
+}
+
+// Returns the number of page faults of the process that needed no I/O, which
+// includes copies on write.
+static size_t
+minor_faults(void)
+{
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return (size_t)ru.ru_minflt;
+}
+
+int
+main(int argc, char **argv)
+{
+	size_t live = (argc > 1 ? strtoull(argv[1], NULL, 10) : 64) * 1024 * 1024;
+	size_t max_size = argc > 2 ? strtoull(argv[2], NULL, 10) : 256;
+	size_t free_pct = argc > 3 ? strtoull(argv[3], NULL, 10) : 50;
+	if (max_size < MIN_SIZE || free_pct > 100) {
+		fprintf(stderr, "usage: bench-fork [live_mb] [max_size] [free_pct]\n");
+		return 1;
+	}
+
+	uint64_t seed = 1;
+	size_t max_blocks = live / MIN_SIZE + 1;
+	// Not from the allocator, whose largest block may be smaller.
+	void **blocks = mmap(NULL, max_blocks * sizeof(void*), PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (blocks == MAP_FAILED) {
+		return 1;
+	}
+	size_t n = 0;
+	for (size_t total = 0; total < live; n++) {
+		size_t size = MIN_SIZE + rng(&seed) % (max_size - MIN_SIZE + 1);
+		blocks[n] = malloc(size);
+		if (blocks[n] == NULL) {
+			fprintf(stderr, "malloc(%zu) failed\n", size);
+			return 1;
+		}
+		memset(blocks[n], 1, size);
+		total += size;
+	}
+	for (size_t i = 0; i < n; i += 4) {
+		free(blocks[i]);
+		blocks[i] = NULL;
+	}
+
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid < 0) {
+		fprintf(stderr, "fork failed\n");
+		return 1;
+	}
+	if (pid == 0) {
+		size_t page_kb = (size_t)sysconf(_SC_PAGESIZE) / 1024;
+		size_t before = minor_faults();
+		// Nothing but the allocator writes, so the new blocks are not even
+		// kept.
+		size_t freed = 0;
+		for (size_t i = 0; i < n; i++) {
+			if (blocks[i] != NULL && rng(&seed) % 100 < free_pct) {
+				free(blocks[i]);
+				freed++;
+			}
+		}
+		size_t after_free = minor_faults();
+		for (size_t i = 0; i < freed; i++) {
+			if (malloc(MIN_SIZE + rng(&seed) % (max_size - MIN_SIZE + 1)) == NULL) {
+				_exit(1);
+			}
+		}
+		size_t after_malloc = minor_faults();
+
+		printf("live_kb:          %zu\n", live / 1024);
+		printf("blocks:           %zu\n", n);
+		printf("free_copied_kb:   %zu\n", (after_free - before) * page_kb);
+		printf("malloc_copied_kb: %zu\n", (after_malloc - after_free) * page_kb);
+		printf("copied_pct:       %.1f\n", 100.0 * (after_malloc - before) * page_kb / (live / 1024));
+		fflush(stdout);
+		_exit(0);
+	}
+	int status;
+	if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "child failed\n");
+		return 1;
+	}
+	return 0;
+}
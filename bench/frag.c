@@ -0,0 +1,253 @@
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "../smalloc.h"
+
+/*
+Fragmentation and footprint over phase-changing workloads.
+
+The heap is driven through five phases:
+
+  build      blocks of small size, 16 to 512 bytes, are allocated until
+             live_mb MiB are live.
+  churn      random blocks are replaced by new small ones, as many times as
+             there are blocks.
+  free       nine in ten blocks are freed, at random.
+  shift      blocks of large size, 1 to 16 KiB, are allocated until live_mb
+             MiB are live again.
+  churn2     random blocks are replaced by new large ones, so the live bytes
+             grow as the small blocks left over are replaced.
+
+Every block is written to in full. Several times per phase, the live bytes
+(the sum of the sizes asked for) are compared with the resident set size from
+/proc/self/statm. Linked with smalloc, they are also compared with the bytes
+the allocator took from the OS and the bytes in its allocated blocks, whose
+excess over the live bytes is what rounding and headers cost, as with buddy.c's
+powers of two. The peak of each ratio is reported at the end.
+
+Given a map file, and linked with buddy.c, the heap map at the end of churn2 is
+written to it, see smalloc_heap_map() and bench-heapmap.
+
+usage: bench-frag [live_mb] [samples_per_phase] [map_file]
+*/
+
+#define SMALL_MIN (16)
+#define SMALL_MAX (512)
+#define LARGE_MIN (1024)
+#define LARGE_MAX (16*1024)
+
+// Not there when linked with another allocator.
+#pragma weak smalloc_heap_stats
+#pragma weak smalloc_heap_map
+
+typedef struct slot_t {
+	void *ptr;
+	size_t size;
+} slot_t;
+
+static slot_t *slots;
+static size_t nslots;
+// One past the last slot that was ever filled.
+static size_t used;
+static size_t live;
+static size_t samples;
+
+static double peak_rss_ratio;
+static double peak_footprint_ratio;
+static double peak_allocated_ratio;
+
+static uint64_t
+rng(uint64_t *state)
+{
+	// https://en.wikipedia.org/wiki/Xorshift#xorshift*
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return *state * 0x2545F4914F6CDD1DULL;
+}
+
+static size_t
+rss(void)
+{
+	char buf[128];
+	int fd = open("/proc/self/statm", O_RDONLY);
+	if (fd < 0) {
+		return 0;
+	}
+	ssize_t n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0) {
+		return 0;
+	}
+	buf[n] = '\0';
+	unsigned long size, resident;
+	if (sscanf(buf, "%lu %lu", &size, &resident) != 2) {
+		return 0;
+	}
+	return resident * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+static double
+ratio(size_t x, size_t y)
+{
+	return y == 0 ? 0 : (double)x / y;
+}
+
+static double
+max(double x, double y)
+{
+	return x > y ? x : y;
+}
+
+static void
+sample(const char *phase, size_t step)
+{
+	size_t r = rss();
+	printf("%8s %6zu %10zu %10zu %8.2f", phase, step, live / 1024, r / 1024, ratio(r, live));
+	peak_rss_ratio = max(peak_rss_ratio, ratio(r, live));
+	if (smalloc_heap_stats != NULL) {
+		smalloc_heap_stats_t stats;
+		smalloc_heap_stats(&stats);
+		printf(" %12zu %8.2f %12zu %8.2f", (size_t)stats.footprint / 1024,
+			ratio(stats.footprint, live), (size_t)stats.allocated / 1024,
+			ratio(stats.allocated, live));
+		peak_footprint_ratio = max(peak_footprint_ratio, ratio(stats.footprint, live));
+		peak_allocated_ratio = max(peak_allocated_ratio, ratio(stats.allocated, live));
+	}
+	printf("\n");
+	fflush(stdout);
+}
+
+static void
+slot_fill(slot_t *s, size_t size)
+{
+	s->ptr = malloc(size);
+	if (s->ptr == NULL) {
+		fprintf(stderr, "malloc(%zu) failed\n", size);
+		exit(1);
+	}
+	memset(s->ptr, 1, size);
+	s->size = size;
+	live += size;
+	used = (size_t)(s - slots) + 1 > used ? (size_t)(s - slots) + 1 : used;
+}
+
+static void
+slot_empty(slot_t *s)
+{
+	free(s->ptr);
+	live -= s->size;
+	s->ptr = NULL;
+	s->size = 0;
+}
+
+// Fills empty slots with blocks of min to max bytes until target bytes are
+// live.
+static void
+build(const char *phase, uint64_t *seed, size_t target, size_t min, size_t max)
+{
+	size_t step = 0;
+	size_t start = live;
+	size_t next = 1;
+	for (size_t i = 0; i < nslots && live < target; i++) {
+		if (slots[i].ptr != NULL) {
+			continue;
+		}
+		slot_fill(&slots[i], min + rng(seed) % (max - min + 1));
+		step++;
+		if (next < samples && live - start >= (target - start) / samples * next) {
+			sample(phase, step);
+			next++;
+		}
+	}
+	sample(phase, step);
+}
+
+// Replaces the blocks in n random full slots with blocks of min to max bytes.
+static void
+churn(const char *phase, uint64_t *seed, size_t n, size_t min, size_t max)
+{
+	size_t every = n / samples + 1;
+	for (size_t step = 1; step <= n; step++) {
+		slot_t *s;
+		do {
+			s = &slots[rng(seed) % used];
+		} while (s->ptr == NULL);
+		slot_empty(s);
+		slot_fill(s, min + rng(seed) % (max - min + 1));
+		if (step % every == 0 || step == n) {
+			sample(phase, step);
+		}
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	size_t target = (argc > 1 ? strtoull(argv[1], NULL, 10) : 16) * 1024 * 1024;
+	samples = argc > 2 ? strtoull(argv[2], NULL, 10) : 4;
+	if (target == 0 || samples == 0) {
+		fprintf(stderr, "usage: bench-frag [live_mb] [samples_per_phase] [map_file]\n");
+		return 1;
+	}
+
+	// Not from the allocator, whose largest block may be smaller, and which
+	// would count it as live.
+	nslots = target / SMALL_MIN + 1;
+	slots = mmap(NULL, nslots * sizeof(slot_t), PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (slots == MAP_FAILED) {
+		return 1;
+	}
+
+	printf("%8s %6s %10s %10s %8s", "phase", "step", "live_kb", "rss_kb", "rss/live");
+	if (smalloc_heap_stats != NULL) {
+		printf(" %12s %8s %12s %8s", "footprint_kb", "fp/live", "allocated_kb", "al/live");
+	}
+	printf("\n");
+
+	uint64_t seed = 1;
+	build("build", &seed, target, SMALL_MIN, SMALL_MAX);
+	size_t nblocks = 0;
+	for (size_t i = 0; i < nslots; i++) {
+		nblocks += slots[i].ptr != NULL;
+	}
+	churn("churn", &seed, nblocks, SMALL_MIN, SMALL_MAX);
+
+	for (size_t i = 0; i < nslots; i++) {
+		if (slots[i].ptr != NULL && rng(&seed) % 10 != 0) {
+			slot_empty(&slots[i]);
+		}
+	}
+	sample("free", 0);
+
+	build("shift", &seed, target, LARGE_MIN, LARGE_MAX);
+	churn("churn2", &seed, nblocks, LARGE_MIN, LARGE_MAX);
+	if (argc > 3 && smalloc_heap_map != NULL) {
+		int fd = open(argv[3], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0 || smalloc_heap_map(fd) != 0) {
+			fprintf(stderr, "can't write %s\n", argv[3]);
+			return 1;
+		}
+		close(fd);
+	}
+
+	for (size_t i = 0; i < nslots; i++) {
+		if (slots[i].ptr != NULL) {
+			slot_empty(&slots[i]);
+		}
+	}
+
+	printf("\n");
+	printf("peak_rss_ratio:       %.2f\n", peak_rss_ratio);
+	if (smalloc_heap_stats != NULL) {
+		printf("peak_footprint_ratio: %.2f\n", peak_footprint_ratio);
+		printf("peak_allocated_ratio: %.2f\n", peak_allocated_ratio);
+	}
+	return 0;
+}
@@ -0,0 +1,291 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/*
+Long-running fragmentation benchmark.
+
+Replays a mixed lifetime workload against whichever malloc the binary is linked
+with: most objects are small and die young, some are medium or large, and a
+small fraction lives for a long time and pins the memory around it. Every
+object is scheduled to die at a fixed step, so the run is deterministic for a
+given seed.
+
+The "small" workload only allocates 8 to 32 byte objects with long lifetimes,
+which makes per-block header overhead show up directly in the footprint. The
+"warmup" workload allocates objects that are never freed, like the start-up
+phase of a service, and is meant to be run for about 100k steps. The "sizes"
+workload draws from a table of size ranges shaped like a typical service,
+including sizes just past a power of two.
+
+The heap footprint is measured as the growth of the program break, and is
+reported next to the number of live bytes. Their ratio is the fragmentation.
+Since the break may move by more than what is in use, the growth of the
+resident set is reported too, sampled every RSS_INTERVAL steps. The number of
+times the break moved is reported as well, it equals the number
+of brk syscalls made by sbrk-based allocators.
+
+usage: bench-heap [mixed|small|warmup|sizes] [steps] [seed]
+*/
+
+#define MAX(x, y) (x > y ? x : y)
+
+#define MAX_LIVE (1 << 16)
+#define HORIZON (1 << 16)
+#define NSAMPLES (16)
+#define RSS_INTERVAL (1024)
+
+typedef struct object_t {
+	void *ptr;
+	size_t size;
+	int32_t next;
+} object_t;
+
+static object_t objects[MAX_LIVE];
+static int32_t free_objects = -1;
+static int32_t deaths[HORIZON];
+
+static uint64_t rng_state;
+
+static uint64_t
+rng(void)
+{
+	// https://en.wikipedia.org/wiki/Xorshift#xorshift*
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+// Returns a size in [1 << lo, 1 << hi), log-uniformly distributed.
+static size_t
+rng_size(int lo, int hi)
+{
+	int e = lo + rng() % (hi - lo);
+	return ((size_t)1 << e) + rng() % ((size_t)1 << e);
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Returns the resident set size in bytes. Reads /proc directly so that stdio
+// doesn't allocate.
+static size_t
+rss(void)
+{
+	char buf[128];
+	int fd = open("/proc/self/statm", O_RDONLY);
+	if (fd < 0) {
+		return 0;
+	}
+	ssize_t n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0) {
+		return 0;
+	}
+	buf[n] = '\0';
+	unsigned long size, resident;
+	if (sscanf(buf, "%lu %lu", &size, &resident) != 2) {
+		return 0;
+	}
+	return resident * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+static void
+pick_mixed(size_t *size, uint64_t *lifetime)
+{
+	uint64_t r = rng() % 100;
+	if (r < 70) {
+		*size = rng_size(3, 8);
+		*lifetime = 1 + rng() % 64;
+	} else if (r < 90) {
+		*size = rng_size(8, 12);
+		*lifetime = 1 + rng() % 1024;
+	} else if (r < 98) {
+		*size = rng_size(12, 16);
+		*lifetime = 1 + rng() % 4096;
+	} else {
+		*size = rng_size(3, 16);
+		*lifetime = 1 + rng() % (HORIZON - 1);
+	}
+}
+
+static void
+pick_small(size_t *size, uint64_t *lifetime)
+{
+	*size = 8 * (1 + rng() % 4);
+	*lifetime = 1 + rng() % 16384;
+}
+
+static void
+pick_warmup(size_t *size, uint64_t *lifetime)
+{
+	*size = rng_size(3, 10);
+	*lifetime = 0;
+}
+
+static const struct {
+	uint64_t weight;
+	size_t lo;
+	size_t hi;
+} size_table[] = {
+	{ 30, 8, 64 },
+	{ 25, 65, 256 },
+	{ 15, 257, 1024 },
+	{ 10, 1025, 4096 },
+	{ 5, 1500, 1500 },
+	{ 5, 4097, 4097 },
+	{ 5, 4097, 16384 },
+	{ 5, 16385, 65536 },
+};
+
+static void
+pick_sizes(size_t *size, uint64_t *lifetime)
+{
+	uint64_t r = rng() % 100;
+	size_t i = 0;
+	while (r >= size_table[i].weight) {
+		r -= size_table[i].weight;
+		i++;
+	}
+	*size = size_table[i].lo + rng() % (size_table[i].hi - size_table[i].lo + 1);
+	*lifetime = 1 + rng() % 2048;
+}
+
+typedef struct workload_t {
+	const char *name;
+	void (*pick)(size_t *size, uint64_t *lifetime);
+} workload_t;
+
+static const workload_t workloads[] = {
+	{ "mixed", pick_mixed },
+	{ "small", pick_small },
+	{ "warmup", pick_warmup },
+	{ "sizes", pick_sizes },
+};
+
+int
+main(int argc, char **argv)
+{
+	const workload_t *w = NULL;
+	const char *name = argc > 1 ? argv[1] : "mixed";
+	for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++) {
+		if (strcmp(workloads[i].name, name) == 0) {
+			w = &workloads[i];
+		}
+	}
+	if (w == NULL) {
+		fprintf(stderr, "usage: %s [mixed|small|warmup|sizes] [steps] [seed]\n", argv[0]);
+		return 1;
+	}
+	uint64_t steps = argc > 2 ? strtoull(argv[2], NULL, 10) : 1000000;
+	rng_state = argc > 3 ? strtoull(argv[3], NULL, 10) : 42;
+	if (rng_state == 0) {
+		rng_state = 1;
+	}
+
+	for (int32_t i = MAX_LIVE - 1; i >= 0; i--) {
+		objects[i].next = free_objects;
+		free_objects = i;
+	}
+	for (size_t i = 0; i < HORIZON; i++) {
+		deaths[i] = -1;
+	}
+
+	// Make sure stdio has its buffers before the baseline is taken.
+	printf("%12s %12s %12s %8s\n", "step", "live_kb", "heap_kb", "frag");
+	fflush(stdout);
+
+	char *brk_start = sbrk(0);
+	size_t rss_start = rss();
+	size_t peak_rss = 0;
+	size_t live = 0;
+	size_t peak_live = 0;
+	size_t peak_heap = 0;
+	uint64_t nallocs = 0;
+	uint64_t nfrees = 0;
+	uint64_t nbrk = 0;
+	char *brk = brk_start;
+	double start = now();
+
+	for (uint64_t t = 0; t < steps; t++) {
+		int32_t *bucket = &deaths[t % HORIZON];
+		while (*bucket != -1) {
+			object_t *o = &objects[*bucket];
+			int32_t next = o->next;
+			free(o->ptr);
+			nfrees++;
+			live -= o->size;
+			o->next = free_objects;
+			free_objects = *bucket;
+			*bucket = next;
+		}
+
+		size_t size;
+		uint64_t lifetime;
+		w->pick(&size, &lifetime);
+		if (lifetime != 0 && free_objects == -1) {
+			continue;
+		}
+		void *ptr = malloc(size);
+		if (ptr == NULL) {
+			fprintf(stderr, "malloc(%zu) failed at step %lu\n", size, (unsigned long)t);
+			return 1;
+		}
+		memset(ptr, (int)t, size);
+		nallocs++;
+
+		// A zero lifetime means the object is never freed.
+		if (lifetime != 0) {
+			int32_t idx = free_objects;
+			object_t *o = &objects[idx];
+			free_objects = o->next;
+			o->ptr = ptr;
+			o->size = size;
+			int32_t *death = &deaths[(t + lifetime) % HORIZON];
+			o->next = *death;
+			*death = idx;
+		}
+
+		live += size;
+		peak_live = MAX(peak_live, live);
+		if ((char *)sbrk(0) != brk) {
+			brk = sbrk(0);
+			nbrk++;
+		}
+		size_t heap = (size_t)(brk - brk_start);
+		peak_heap = MAX(peak_heap, heap);
+		if (t % RSS_INTERVAL == 0) {
+			size_t r = rss();
+			r = r > rss_start ? r - rss_start : 0;
+			peak_rss = MAX(peak_rss, r);
+		}
+
+		if ((t + 1) % (MAX(steps / NSAMPLES, 1)) == 0) {
+			printf("%12lu %12zu %12zu %8.2f\n", (unsigned long)(t + 1),
+				live / 1024, heap / 1024, live ? (double)heap / live : 0.0);
+		}
+	}
+
+	double elapsed = now() - start;
+	printf("\n");
+	printf("workload:       %s\n", w->name);
+	printf("allocs:         %lu\n", (unsigned long)nallocs);
+	printf("elapsed_s:      %.3f\n", elapsed);
+	printf("ops_per_s:      %.0f\n", elapsed > 0 ? (nallocs + nfrees) / elapsed : 0.0);
+	printf("brk_moves:      %lu\n", (unsigned long)nbrk);
+	printf("peak_live_kb:   %zu\n", peak_live / 1024);
+	printf("peak_heap_kb:   %zu\n", peak_heap / 1024);
+	printf("peak_frag:      %.2f\n", peak_live ? (double)peak_heap / peak_live : 0.0);
+	printf("peak_rss_kb:    %zu\n", peak_rss / 1024);
+	return 0;
+}
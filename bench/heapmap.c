@@ -0,0 +1,183 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+Renders a heap map written by smalloc_heap_map(), see smalloc.h.
+
+For every arena, prints the free bytes, the free blocks of each order, the
+largest free block, and the fragmentation: the share of the free bytes that a
+single request can't get at, 1 - largest/free. A request larger than the
+largest free block fails however many bytes are free. The arena is then drawn
+in ROWS lines of COLS chars, each standing for a stretch of min blocks, by how
+much of it is allocated: ' ' for none, then '.', ':', '+', and '#' for all of
+it. A '|' replaces the char of a stretch that holds three or more free
+blocks, where the free space is cut into pieces.
+
+Given an image file, also writes the maps as a PGM image, one pixel per min
+block and one row per line of the map, the arenas one below the other: black
+when allocated, white when free, and grey for the first min block of a free
+block.
+
+usage: bench-heapmap map [image.pgm]
+*/
+
+#define ROWS (16)
+#define COLS (64)
+#define MAX_ORDERS (64)
+
+typedef struct arena_map_t {
+	int index;
+	uint64_t free[MAX_ORDERS];
+	char *map;
+	size_t len;
+	size_t cap;
+} arena_map_t;
+
+static arena_map_t *arenas;
+static size_t narenas;
+static size_t width;
+
+static void*
+xrealloc(void *ptr, size_t size)
+{
+	ptr = realloc(ptr, size);
+	if (ptr == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	return ptr;
+}
+
+static void
+map_append(arena_map_t *a, const char *line, size_t n)
+{
+	if (a->len + n > a->cap) {
+		a->cap = a->cap * 2 + n;
+		a->map = xrealloc(a->map, a->cap);
+	}
+	memcpy(a->map + a->len, line, n);
+	a->len += n;
+}
+
+static void
+render(const arena_map_t *a, size_t min_size, size_t norders)
+{
+	uint64_t free_bytes = 0;
+	uint64_t free_blocks = 0;
+	uint64_t largest = 0;
+	for (size_t k = 0; k < norders; k++) {
+		free_bytes += a->free[k] * (min_size << k);
+		free_blocks += a->free[k];
+		if (a->free[k] > 0) {
+			largest = min_size << k;
+		}
+	}
+	printf("arena %d: %lu of %lu KiB free in %lu blocks, largest %lu KiB, fragmentation %.2f\n",
+		a->index, (unsigned long)(free_bytes / 1024),
+		(unsigned long)(a->len * min_size / 1024), (unsigned long)free_blocks,
+		(unsigned long)(largest / 1024), free_bytes > 0 ? 1 - (double)largest / free_bytes : 0);
+	printf("  %6s %10s %8s\n", "order", "size", "free");
+	for (size_t k = 0; k < norders; k++) {
+		if (a->free[k] > 0) {
+			printf("  %6zu %10zu %8lu\n", k, min_size << k, (unsigned long)a->free[k]);
+		}
+	}
+
+	size_t cells = ROWS * COLS;
+	size_t per_cell = a->len / cells > 0 ? a->len / cells : 1;
+	for (size_t c = 0; c < cells && c * per_cell < a->len; c++) {
+		if (c % COLS == 0) {
+			printf("  ");
+		}
+		size_t used = 0;
+		size_t starts = 0;
+		for (size_t j = c * per_cell; j < (c + 1) * per_cell && j < a->len; j++) {
+			used += a->map[j] == '#';
+			starts += a->map[j] == '|';
+		}
+		static const char shades[] = " .:+#";
+		char ch = shades[used == 0 ? 0 : used == per_cell ? 4 : 1 + 3 * used / per_cell];
+		putchar(starts >= 3 ? '|' : ch);
+		if (c % COLS == COLS - 1) {
+			putchar('\n');
+		}
+	}
+	printf("\n");
+}
+
+static int
+write_pgm(const char *path)
+{
+	FILE *fp = fopen(path, "wb");
+	if (fp == NULL) {
+		fprintf(stderr, "can't write %s\n", path);
+		return -1;
+	}
+	size_t rows = 0;
+	for (size_t i = 0; i < narenas; i++) {
+		rows += arenas[i].len / width;
+	}
+	fprintf(fp, "P5\n%zu %zu\n255\n", width, rows);
+	for (size_t i = 0; i < narenas; i++) {
+		for (size_t j = 0; j < arenas[i].len / width * width; j++) {
+			char c = arenas[i].map[j];
+			fputc(c == '#' ? 0 : c == '|' ? 128 : 255, fp);
+		}
+	}
+	return fclose(fp) == 0 ? 0 : -1;
+}
+
+int
+main(int argc, char **argv)
+{
+	if (argc < 2) {
+		fprintf(stderr, "usage: bench-heapmap map [image.pgm]\n");
+		return 1;
+	}
+	FILE *fp = fopen(argv[1], "r");
+	if (fp == NULL) {
+		fprintf(stderr, "can't read %s\n", argv[1]);
+		return 1;
+	}
+	char line[4096];
+	size_t min_size, total_size;
+	if (fgets(line, sizeof(line), fp) == NULL ||
+			sscanf(line, "heapmap %zu %zu", &min_size, &total_size) != 2 || min_size == 0) {
+		fprintf(stderr, "%s is not a heap map\n", argv[1]);
+		return 1;
+	}
+	size_t norders = 0;
+	while ((min_size << norders) <= total_size && norders < MAX_ORDERS) {
+		norders++;
+	}
+
+	arena_map_t *a = NULL;
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		size_t n = strcspn(line, "\n");
+		int i;
+		size_t k;
+		unsigned long count;
+		if (sscanf(line, "arena %d", &i) == 1) {
+			arenas = xrealloc(arenas, (narenas + 1) * sizeof(arena_map_t));
+			a = &arenas[narenas++];
+			memset(a, 0, sizeof(*a));
+			a->index = i;
+		} else if (a != NULL && sscanf(line, "order %zu %lu", &k, &count) == 2 && k < MAX_ORDERS) {
+			a->free[k] = count;
+		} else if (a != NULL && n > 0) {
+			width = n;
+			map_append(a, line, n);
+		}
+	}
+	fclose(fp);
+
+	for (size_t i = 0; i < narenas; i++) {
+		render(&arenas[i], min_size, norders);
+	}
+	if (argc > 2 && narenas > 0 && write_pgm(argv[2]) != 0) {
+		return 1;
+	}
+	return 0;
+}
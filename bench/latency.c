@@ -0,0 +1,194 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+Latency of single calls.
+
+Every malloc(), free() and realloc() is timed on its own, and the times go into
+one histogram per call. A random slot out of nslots is picked for every call.
+An empty slot gets a new block. A full slot is freed, or, one time in four,
+reallocated. Sizes are drawn so that every power of two up to max_size is
+equally likely, which makes large blocks and long realloc() copies rare but
+present. The histograms keep 16 buckets per power of two, so percentiles are
+within about 6%. The cost of reading the clock is measured up front and
+reported, but not subtracted. The defaults keep the live heap well below the
+2 MiB arena a single thread gets from buddy.c.
+
+usage: bench-latency [ops] [nslots] [max_size]
+*/
+
+#define MIN_SIZE (16)
+// Buckets per power of two is 1 << SUB_BITS.
+#define SUB_BITS (4)
+#define NBUCKETS (64 << SUB_BITS)
+
+enum { OP_MALLOC, OP_FREE, OP_REALLOC, NOPS };
+
+static const char *op_names[NOPS] = {"malloc", "free", "realloc"};
+
+typedef struct histogram_t {
+	uint64_t counts[NBUCKETS];
+	uint64_t count;
+	uint64_t max;
+	uint64_t total;
+} histogram_t;
+
+static histogram_t histograms[NOPS];
+
+static uint64_t
+rng(uint64_t *state)
+{
+	// https://en.wikipedia.org/wiki/Xorshift#xorshift*
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return *state * 0x2545F4914F6CDD1DULL;
+}
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Values below 2 << SUB_BITS get a bucket each. Above that, every power of two
+// is split into 1 << SUB_BITS buckets of equal width.
+static size_t
+bucket(uint64_t v)
+{
+	if (v < (2 << SUB_BITS)) {
+		return v;
+	}
+	int e = 63 - __builtin_clzll(v);
+	return ((size_t)(e - SUB_BITS) << SUB_BITS) + (v >> (e - SUB_BITS));
+}
+
+// Returns the largest value that falls into bucket i.
+static uint64_t
+bucket_max(size_t i)
+{
+	if (i < (2 << SUB_BITS)) {
+		return i;
+	}
+	int shift = (int)(i >> SUB_BITS) - 1;
+	uint64_t m = (i & ((1 << SUB_BITS) - 1)) | (1 << SUB_BITS);
+	return ((m + 1) << shift) - 1;
+}
+
+static void
+record(histogram_t *h, uint64_t v)
+{
+	h->counts[bucket(v)]++;
+	h->count++;
+	h->total += v;
+	h->max = v > h->max ? v : h->max;
+}
+
+static uint64_t
+percentile(const histogram_t *h, double p)
+{
+	uint64_t rank = (uint64_t)(p / 100 * h->count);
+	uint64_t seen = 0;
+	for (size_t i = 0; i < NBUCKETS; i++) {
+		seen += h->counts[i];
+		if (seen > rank) {
+			return bucket_max(i) < h->max ? bucket_max(i) : h->max;
+		}
+	}
+	return h->max;
+}
+
+static size_t
+random_size(uint64_t *seed, size_t max_size)
+{
+	int max_shift = 63 - __builtin_clzll(max_size);
+	int shift = 4 + rng(seed) % (max_shift - 3);
+	size_t size = ((size_t)1 << shift) + rng(seed) % ((size_t)1 << shift);
+	return size > max_size ? max_size : size;
+}
+
+int
+main(int argc, char **argv)
+{
+	size_t ops = argc > 1 ? strtoull(argv[1], NULL, 10) : 2000000;
+	size_t nslots = argc > 2 ? strtoull(argv[2], NULL, 10) : 256;
+	size_t max_size = argc > 3 ? strtoull(argv[3], NULL, 10) : 16384;
+	if (nslots == 0 || max_size < 2 * MIN_SIZE) {
+		fprintf(stderr, "usage: bench-latency [ops] [nslots] [max_size]\n");
+		return 1;
+	}
+
+	char **slots = calloc(nslots, sizeof(char*));
+	if (slots == NULL) {
+		return 1;
+	}
+
+	histogram_t clock;
+	memset(&clock, 0, sizeof(clock));
+	for (size_t i = 0; i < 100000; i++) {
+		uint64_t start = now_ns();
+		record(&clock, now_ns() - start);
+	}
+
+	uint64_t seed = 1;
+	for (size_t i = 0; i < ops; i++) {
+		size_t slot = rng(&seed) % nslots;
+		uint64_t start, end;
+		if (slots[slot] == NULL) {
+			size_t size = random_size(&seed, max_size);
+			start = now_ns();
+			slots[slot] = malloc(size);
+			end = now_ns();
+			record(&histograms[OP_MALLOC], end - start);
+			if (slots[slot] == NULL) {
+				fprintf(stderr, "malloc(%zu) failed\n", size);
+				return 1;
+			}
+			slots[slot][0] = 1;
+		} else if (rng(&seed) % 4 == 0) {
+			size_t size = random_size(&seed, max_size);
+			start = now_ns();
+			char *ptr = realloc(slots[slot], size);
+			end = now_ns();
+			record(&histograms[OP_REALLOC], end - start);
+			if (ptr == NULL) {
+				fprintf(stderr, "realloc(%zu) failed\n", size);
+				return 1;
+			}
+			ptr[size - 1] = 1;
+			slots[slot] = ptr;
+		} else {
+			start = now_ns();
+			free(slots[slot]);
+			end = now_ns();
+			record(&histograms[OP_FREE], end - start);
+			slots[slot] = NULL;
+		}
+	}
+	for (size_t i = 0; i < nslots; i++) {
+		free(slots[i]);
+	}
+	free(slots);
+
+	printf("%8s %10s %8s %8s %8s %8s %10s\n", "op", "count", "mean_ns", "p50_ns",
+		"p99_ns", "p99.9_ns", "max_ns");
+	for (int op = 0; op < NOPS; op++) {
+		const histogram_t *h = &histograms[op];
+		if (h->count == 0) {
+			continue;
+		}
+		printf("%8s %10lu %8.0f %8lu %8lu %8lu %10lu\n", op_names[op],
+			(unsigned long)h->count, (double)h->total / h->count,
+			(unsigned long)percentile(h, 50), (unsigned long)percentile(h, 99),
+			(unsigned long)percentile(h, 99.9), (unsigned long)h->max);
+	}
+	printf("\n");
+	printf("clock_p50_ns:   %lu\n", (unsigned long)percentile(&clock, 50));
+	printf("clock_p99_ns:   %lu\n", (unsigned long)percentile(&clock, 99));
+	return 0;
+}
@@ -0,0 +1,287 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+Standard multithreaded allocator workloads.
+
+The binary is linked with nothing but libc, so that any allocator can be
+loaded with LD_PRELOAD. Every workload is run with 1, 2, 4, ... threads up to
+the given maximum, and each thread does the same number of operations, where
+every malloc() and every free() is one operation. The throughput of each run
+is reported.
+
+  larson      Modeled on Larson and Krishnan's server simulation. Every thread
+              replaces blocks of 16 to 128 bytes in random slots of its own
+              array. After every round the threads pass their arrays on, so
+              that most blocks are freed by another thread than the one that
+              allocated them.
+  xmalloc     Modeled on xmalloc-test. Every thread allocates a batch of
+              blocks, takes whichever batch is on top of a shared stack, puts
+              its own there and frees the one it took, which is often from
+              another thread.
+  threadtest  Modeled on Hoard's threadtest. Every thread allocates a batch of
+              blocks of one size and frees them again, all on its own.
+  shbench     Modeled on MicroQuill's SmartHeap benchmark. Every thread
+              allocates blocks of mostly small but sometimes large size, frees
+              every other one, refills the holes and frees all of them.
+
+usage: bench-mt [workload|all] [max_threads] [ops_per_thread]
+*/
+
+#define MAX(x, y) (x > y ? x : y)
+
+#define LARSON_SLOTS (1000)
+#define LARSON_ROUNDS (16)
+#define BATCH (64)
+#define THREADTEST_SIZE (64)
+
+typedef struct worker_t {
+	pthread_t thread;
+	size_t id;
+	uint64_t seed;
+	uint64_t ops;
+} worker_t;
+
+typedef struct batch_t {
+	struct batch_t *next;
+	void *ptrs[BATCH];
+} batch_t;
+
+static pthread_barrier_t barrier;
+static size_t nthreads;
+
+// The arrays of the larson threads. Thread i works on arrays[(i + round) %
+// nthreads] in a round.
+static void **arrays;
+
+// The shared stack of xmalloc batches.
+static pthread_mutex_t stack_lock = PTHREAD_MUTEX_INITIALIZER;
+static batch_t *stack;
+
+static uint64_t
+rng(uint64_t *state)
+{
+	// https://en.wikipedia.org/wiki/Xorshift#xorshift*
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return *state * 0x2545F4914F6CDD1DULL;
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void*
+xmalloc(size_t size)
+{
+	char *ptr = malloc(size);
+	if (ptr == NULL) {
+		fprintf(stderr, "malloc(%zu) failed\n", size);
+		exit(1);
+	}
+	ptr[0] = 1;
+	return ptr;
+}
+
+static void*
+larson(void *arg)
+{
+	worker_t *w = arg;
+	uint64_t per_round = w->ops / LARSON_ROUNDS / 2;
+	for (size_t round = 0; round < LARSON_ROUNDS; round++) {
+		void **slots = &arrays[((w->id + round) % nthreads) * LARSON_SLOTS];
+		for (uint64_t i = 0; i < per_round; i++) {
+			uint64_t r = rng(&w->seed);
+			size_t slot = r % LARSON_SLOTS;
+			free(slots[slot]);
+			slots[slot] = xmalloc(16 + (r >> 32) % 113);
+		}
+		pthread_barrier_wait(&barrier);
+	}
+	return NULL;
+}
+
+static void*
+xmalloc_test(void *arg)
+{
+	worker_t *w = arg;
+	for (uint64_t n = 0; n < w->ops; n += 2 * BATCH) {
+		batch_t *b = xmalloc(sizeof(batch_t));
+		for (size_t i = 0; i < BATCH; i++) {
+			b->ptrs[i] = xmalloc(16 + rng(&w->seed) % 241);
+		}
+		// Take the top batch before pushing ours, so that we never get ours
+		// back right away.
+		pthread_mutex_lock(&stack_lock);
+		batch_t *top = stack;
+		if (top != NULL) {
+			stack = top->next;
+		}
+		b->next = stack;
+		stack = b;
+		pthread_mutex_unlock(&stack_lock);
+		if (top == NULL) {
+			continue;
+		}
+		b = top;
+		for (size_t i = 0; i < BATCH; i++) {
+			free(b->ptrs[i]);
+		}
+		free(b);
+	}
+	return NULL;
+}
+
+static void*
+threadtest(void *arg)
+{
+	worker_t *w = arg;
+	void *ptrs[BATCH];
+	for (uint64_t n = 0; n < w->ops; n += 2 * BATCH) {
+		for (size_t i = 0; i < BATCH; i++) {
+			ptrs[i] = xmalloc(THREADTEST_SIZE);
+		}
+		for (size_t i = 0; i < BATCH; i++) {
+			free(ptrs[i]);
+		}
+	}
+	return NULL;
+}
+
+// Nine in ten blocks are up to 64 bytes, and one in a hundred is up to 8 KiB.
+static size_t
+shbench_size(uint64_t *seed)
+{
+	uint64_t r = rng(seed);
+	switch (r % 100) {
+	case 0:
+		return 1024 + (r >> 32) % (7 * 1024);
+	case 1: case 2: case 3: case 4: case 5: case 6: case 7: case 8: case 9:
+		return 64 + (r >> 32) % 960;
+	default:
+		return 8 + (r >> 32) % 57;
+	}
+}
+
+static void*
+shbench(void *arg)
+{
+	worker_t *w = arg;
+	void *ptrs[BATCH];
+	for (uint64_t n = 0; n < w->ops; n += 3 * BATCH) {
+		for (size_t i = 0; i < BATCH; i++) {
+			ptrs[i] = xmalloc(shbench_size(&w->seed));
+		}
+		for (size_t i = 1; i < BATCH; i += 2) {
+			free(ptrs[i]);
+			ptrs[i] = xmalloc(shbench_size(&w->seed));
+		}
+		for (size_t i = BATCH; i > 0; i--) {
+			free(ptrs[i - 1]);
+		}
+	}
+	return NULL;
+}
+
+static const struct {
+	const char *name;
+	void *(*run)(void*);
+} workloads[] = {
+	{"larson", larson},
+	{"xmalloc", xmalloc_test},
+	{"threadtest", threadtest},
+	{"shbench", shbench},
+};
+
+static int
+run(size_t w, size_t max_threads, uint64_t ops)
+{
+	worker_t *workers = calloc(max_threads, sizeof(worker_t));
+	if (workers == NULL) {
+		return 1;
+	}
+	for (size_t n = 1; n <= max_threads; n *= 2) {
+		nthreads = n;
+		if (workloads[w].run == larson) {
+			arrays = calloc(n * LARSON_SLOTS, sizeof(void*));
+			if (arrays == NULL) {
+				return 1;
+			}
+			pthread_barrier_init(&barrier, NULL, n);
+		}
+		double start = now();
+		for (size_t i = 0; i < n; i++) {
+			workers[i].id = i;
+			workers[i].seed = i + 1;
+			workers[i].ops = ops;
+			if (pthread_create(&workers[i].thread, NULL, workloads[w].run, &workers[i]) != 0) {
+				fprintf(stderr, "pthread_create failed\n");
+				return 1;
+			}
+		}
+		for (size_t i = 0; i < n; i++) {
+			pthread_join(workers[i].thread, NULL);
+		}
+		double elapsed = now() - start;
+		if (workloads[w].run == larson) {
+			pthread_barrier_destroy(&barrier);
+			for (size_t i = 0; i < n * LARSON_SLOTS; i++) {
+				free(arrays[i]);
+			}
+			free(arrays);
+		}
+		while (stack != NULL) {
+			batch_t *b = stack;
+			stack = b->next;
+			for (size_t i = 0; i < BATCH; i++) {
+				free(b->ptrs[i]);
+			}
+			free(b);
+		}
+		printf("%12s %8zu %12lu %10.3f %14.0f\n", workloads[w].name, n,
+			(unsigned long)(n * ops), elapsed, n * ops / elapsed);
+		fflush(stdout);
+	}
+	free(workers);
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	const char *name = argc > 1 ? argv[1] : "all";
+	size_t max_threads = argc > 2 ? strtoull(argv[2], NULL, 10) : (size_t)MAX(2 * ncpu, 4);
+	uint64_t ops = argc > 3 ? strtoull(argv[3], NULL, 10) : 2000000;
+
+	size_t nworkloads = sizeof(workloads) / sizeof(workloads[0]);
+	int found = strcmp(name, "all") == 0;
+	for (size_t w = 0; w < nworkloads; w++) {
+		found |= strcmp(name, workloads[w].name) == 0;
+	}
+	if (!found || max_threads == 0) {
+		fprintf(stderr, "usage: bench-mt [workload|all] [max_threads] [ops_per_thread]\n");
+		return 1;
+	}
+
+	printf("%12s %8s %12s %10s %14s\n", "workload", "threads", "ops", "elapsed_s", "ops_per_s");
+	for (size_t w = 0; w < nworkloads; w++) {
+		if (strcmp(name, "all") != 0 && strcmp(name, workloads[w].name) != 0) {
+			continue;
+		}
+		if (run(w, max_threads, ops) != 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
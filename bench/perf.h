@@ -0,0 +1,117 @@
+#ifndef PERF_H
+#define PERF_H
+
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/*
+Hardware performance counters for the benchmarks.
+
+perf_open() opens one counter per event in PERF_EVENTS for the calling thread,
+counting user space only, and perf_start() and perf_stop() bracket a phase of
+a benchmark. Each counter is opened on its own rather than in a group, so that
+one the CPU or the kernel does not have (as in most virtual machines, or with
+kernel.perf_event_paranoid above 2) only leaves its own column empty. When the
+kernel multiplexes the counters, the counts are scaled up by the time each
+counter ran.
+
+perf_count() returns -1 for a counter that could not be opened or read.
+*/
+
+typedef struct perf_event_t {
+	const char *name;
+	uint32_t type;
+	uint64_t config;
+} perf_event_t;
+
+#define PERF_CACHE_MISS(cache) \
+	((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+static const perf_event_t perf_events[] = {
+	{"l1d_miss", PERF_TYPE_HW_CACHE, PERF_CACHE_MISS(PERF_COUNT_HW_CACHE_L1D)},
+	{"llc_miss", PERF_TYPE_HW_CACHE, PERF_CACHE_MISS(PERF_COUNT_HW_CACHE_LL)},
+	{"dtlb_miss", PERF_TYPE_HW_CACHE, PERF_CACHE_MISS(PERF_COUNT_HW_CACHE_DTLB)},
+	{"branch_miss", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+};
+
+#define PERF_EVENTS (sizeof(perf_events) / sizeof(perf_events[0]))
+
+typedef struct perf_t {
+	int fds[PERF_EVENTS];
+	// Counts of the last phase, or -1.
+	int64_t counts[PERF_EVENTS];
+} perf_t;
+
+// Opens the counters. Returns the number that could be opened.
+static inline size_t
+perf_open(perf_t *p)
+{
+	size_t n = 0;
+	for (size_t i = 0; i < PERF_EVENTS; i++) {
+		struct perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = perf_events[i].type;
+		attr.config = perf_events[i].config;
+		attr.disabled = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+		p->fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+		p->counts[i] = -1;
+		n += p->fds[i] >= 0;
+	}
+	return n;
+}
+
+static inline void
+perf_start(perf_t *p)
+{
+	for (size_t i = 0; i < PERF_EVENTS; i++) {
+		if (p->fds[i] >= 0) {
+			ioctl(p->fds[i], PERF_EVENT_IOC_RESET, 0);
+			ioctl(p->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+		}
+	}
+}
+
+static inline void
+perf_stop(perf_t *p)
+{
+	for (size_t i = 0; i < PERF_EVENTS; i++) {
+		p->counts[i] = -1;
+		if (p->fds[i] < 0) {
+			continue;
+		}
+		ioctl(p->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+		// The count, the time enabled and the time running.
+		uint64_t v[3];
+		if (read(p->fds[i], v, sizeof(v)) != sizeof(v) || v[2] == 0) {
+			continue;
+		}
+		p->counts[i] = v[2] < v[1] ? (int64_t)((double)v[0] * v[1] / v[2]) : (int64_t)v[0];
+	}
+}
+
+static inline int64_t
+perf_count(const perf_t *p, size_t i)
+{
+	return p->counts[i];
+}
+
+static inline void
+perf_close(perf_t *p)
+{
+	for (size_t i = 0; i < PERF_EVENTS; i++) {
+		if (p->fds[i] >= 0) {
+			close(p->fds[i]);
+		}
+		p->fds[i] = -1;
+	}
+}
+
+#endif
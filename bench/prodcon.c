@@ -0,0 +1,146 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+Producer/consumer benchmark.
+
+Objects are allocated on one thread and freed on another. Each producer
+allocates objects of random size, writes to them and passes them through a ring
+buffer to its consumer, which checks and frees them. All pairs run at once and
+the total throughput in objects per second is reported.
+
+usage: bench-prodcon [pairs] [objects_per_pair] [max_size]
+*/
+
+#define RING_SIZE (128)
+#define MIN_SIZE (16)
+
+typedef struct ring_t {
+	void *slots[RING_SIZE];
+	// Written by the producer and the consumer only, on separate lines.
+	size_t head __attribute__((aligned(64)));
+	size_t tail __attribute__((aligned(64)));
+} ring_t;
+
+typedef struct pair_t {
+	pthread_t producer;
+	pthread_t consumer;
+	ring_t ring;
+	uint64_t seed;
+	uint64_t objects;
+	size_t max_size;
+	int ok;
+} pair_t;
+
+static uint64_t
+rng(uint64_t *state)
+{
+	// https://en.wikipedia.org/wiki/Xorshift#xorshift*
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return *state * 0x2545F4914F6CDD1DULL;
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void*
+producer(void *arg)
+{
+	pair_t *p = arg;
+	ring_t *r = &p->ring;
+	for (uint64_t i = 0; i < p->objects; i++) {
+		size_t size = MIN_SIZE + rng(&p->seed) % (p->max_size - MIN_SIZE + 1);
+		unsigned char *obj = malloc(size);
+		if (obj == NULL) {
+			fprintf(stderr, "malloc(%zu) failed\n", size);
+			exit(1);
+		}
+		obj[0] = (unsigned char)i;
+		obj[size - 1] = (unsigned char)i;
+		while (i - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >= RING_SIZE) {
+			sched_yield();
+		}
+		r->slots[i % RING_SIZE] = obj;
+		__atomic_store_n(&r->head, i + 1, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+
+static void*
+consumer(void *arg)
+{
+	pair_t *p = arg;
+	ring_t *r = &p->ring;
+	p->ok = 1;
+	for (uint64_t i = 0; i < p->objects; i++) {
+		while (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == i) {
+			sched_yield();
+		}
+		unsigned char *obj = r->slots[i % RING_SIZE];
+		p->ok &= obj[0] == (unsigned char)i;
+		free(obj);
+		__atomic_store_n(&r->tail, i + 1, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+
+int
+main(int argc, char **argv)
+{
+	size_t npairs = argc > 1 ? strtoull(argv[1], NULL, 10) : 4;
+	uint64_t objects = argc > 2 ? strtoull(argv[2], NULL, 10) : 1000000;
+	size_t max_size = argc > 3 ? strtoull(argv[3], NULL, 10) : 4096;
+	if (npairs == 0 || max_size < MIN_SIZE) {
+		fprintf(stderr, "usage: bench-prodcon [pairs] [objects_per_pair] [max_size]\n");
+		return 1;
+	}
+
+	pair_t *pairs = calloc(npairs, sizeof(pair_t));
+	if (pairs == NULL) {
+		return 1;
+	}
+
+	double start = now();
+	for (size_t i = 0; i < npairs; i++) {
+		pairs[i].seed = i + 1;
+		pairs[i].objects = objects;
+		pairs[i].max_size = max_size;
+		if (pthread_create(&pairs[i].consumer, NULL, consumer, &pairs[i]) != 0 ||
+				pthread_create(&pairs[i].producer, NULL, producer, &pairs[i]) != 0) {
+			fprintf(stderr, "pthread_create failed\n");
+			return 1;
+		}
+	}
+	int ok = 1;
+	for (size_t i = 0; i < npairs; i++) {
+		pthread_join(pairs[i].producer, NULL);
+		pthread_join(pairs[i].consumer, NULL);
+		ok &= pairs[i].ok;
+	}
+	double elapsed = now() - start;
+	free(pairs);
+	if (!ok) {
+		fprintf(stderr, "object corrupted\n");
+		return 1;
+	}
+
+	printf("pairs:          %zu\n", npairs);
+	printf("objects:        %lu\n", (unsigned long)(npairs * objects));
+	printf("max_size:       %zu\n", max_size);
+	printf("elapsed_s:      %.3f\n", elapsed);
+	printf("objects_per_s:  %.0f\n", npairs * objects / elapsed);
+	return 0;
+}
@@ -0,0 +1,156 @@
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../smalloc.h"
+#include "trace.h"
+
+/*
+Replays an allocation trace recorded with trace.so.
+
+The trace is first turned into operations on numbered slots, see trace.h. The
+calls are then made in the recorded order on a single thread, against
+whichever malloc the binary is linked with, and the time they take is
+reported. The blocks are not written to, apart from what calloc() does.
+
+Every SAMPLE_EVERY calls, the resident set size is read from /proc/self/statm,
+and with smalloc the allocator's footprint too. The resident set size is
+reported as its growth since the start of the replay, which leaves out the
+harness. The peaks of those and of the live bytes are reported. The time spent
+sampling is not counted.
+
+usage: bench-replay trace
+*/
+
+#define SAMPLE_EVERY (4096)
+
+// Not there when linked with another allocator.
+#pragma weak smalloc_heap_stats
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t
+rss(void)
+{
+	char buf[128];
+	int fd = open("/proc/self/statm", O_RDONLY);
+	if (fd < 0) {
+		return 0;
+	}
+	ssize_t n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0) {
+		return 0;
+	}
+	buf[n] = '\0';
+	unsigned long size, resident;
+	if (sscanf(buf, "%lu %lu", &size, &resident) != 2) {
+		return 0;
+	}
+	return resident * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+int
+main(int argc, char **argv)
+{
+	if (argc < 2) {
+		fprintf(stderr, "usage: bench-replay trace\n");
+		return 1;
+	}
+	trace_t t;
+	if (trace_load(argv[1], &t) != 0) {
+		return 1;
+	}
+	const trace_op_t *ops = t.ops;
+	size_t nops = t.nops;
+	// Zeroed and touched up front, so that what the resident set grows by
+	// from here is the allocator's.
+	void **slots = trace_map((t.nslots + 1) * sizeof(void*));
+	size_t *sizes = trace_map((t.nslots + 1) * sizeof(size_t));
+	if (slots == NULL || sizes == NULL) {
+		return 1;
+	}
+	memset(slots, 0, (t.nslots + 1) * sizeof(void*));
+	memset(sizes, 0, (t.nslots + 1) * sizeof(size_t));
+	size_t base_rss = rss();
+
+	size_t live = 0;
+	size_t peak_live = 0;
+	size_t peak_rss = 0;
+	size_t peak_footprint = 0;
+	double elapsed = 0;
+	for (size_t i = 0; i < nops;) {
+		size_t begin = i;
+		size_t end = i + SAMPLE_EVERY < nops ? i + SAMPLE_EVERY : nops;
+		double start = now();
+		for (; i < end; i++) {
+			const trace_op_t *o = &ops[i];
+			switch (o->op) {
+			case TRACE_MALLOC:
+				slots[o->slot] = malloc(o->size);
+				break;
+			case TRACE_CALLOC:
+				slots[o->slot] = calloc(1, o->size);
+				break;
+			case TRACE_REALLOC:
+				slots[o->slot] = realloc(slots[o->old], o->size);
+				slots[o->old] = NULL;
+				break;
+			case TRACE_FREE:
+				free(slots[o->slot]);
+				slots[o->slot] = NULL;
+				break;
+			}
+			if (o->op != TRACE_FREE && slots[o->slot] == NULL && o->size > 0) {
+				fprintf(stderr, "allocation of %lu bytes failed\n", (unsigned long)o->size);
+				return 1;
+			}
+		}
+		elapsed += now() - start;
+
+		// Live bytes are counted after the fact, so as not to slow down the
+		// replay.
+		for (size_t j = begin; j < end; j++) {
+			const trace_op_t *o = &ops[j];
+			if (o->op == TRACE_FREE) {
+				live -= sizes[o->slot];
+				continue;
+			}
+			if (o->op == TRACE_REALLOC) {
+				live -= sizes[o->old];
+			}
+			sizes[o->slot] = o->size;
+			live += o->size;
+			peak_live = live > peak_live ? live : peak_live;
+		}
+		size_t r = rss();
+		r = r > base_rss ? r - base_rss : 0;
+		peak_rss = r > peak_rss ? r : peak_rss;
+		if (smalloc_heap_stats != NULL) {
+			smalloc_heap_stats_t stats;
+			smalloc_heap_stats(&stats);
+			peak_footprint = stats.footprint > peak_footprint ? stats.footprint : peak_footprint;
+		}
+	}
+
+	printf("records:           %zu\n", t.nrecs);
+	printf("calls:             %zu\n", nops);
+	printf("elapsed_s:         %.3f\n", elapsed);
+	printf("ns_per_call:       %.1f\n", nops > 0 ? elapsed * 1e9 / nops : 0);
+	printf("peak_live_kb:      %zu\n", peak_live / 1024);
+	printf("peak_rss_kb:       %zu\n", peak_rss / 1024);
+	if (smalloc_heap_stats != NULL) {
+		printf("peak_footprint_kb: %zu\n", peak_footprint / 1024);
+	}
+	return 0;
+}
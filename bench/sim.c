@@ -0,0 +1,766 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+
+/*
+Offline allocator simulator.
+
+Replays a trace recorded with trace.so against models of buddy.c and ll.c, for
+a grid of settings at once, without allocating any of the blocks. The models
+place blocks the way the allocators do, but only keep track of offsets:
+
+  buddy  __MIN_SIZE and __TOTAL_SIZE. Blocks are rounded up to a power of two
+         and taken from a spacetree per arena. Like a single thread of
+         buddy.c, the model stays in its arena until it runs out, then takes
+         the first arena with room, and only then a new one.
+  list   LL_POLICY and __ALIGN. Blocks have an 8-byte header and are rounded
+         up to the alignment. Small blocks are placed by the policy, large
+         ones by best fit, and the rest is carved from the top of the heap.
+         Free blocks are split and merged as in ll.c.
+
+Neither the thread cache nor giving pages back to the OS is modeled, and
+realloc() moves a block whenever it grows, as both allocators do.
+
+For every setting, the peaks of the live bytes (the sizes asked for), the
+allocated bytes (whole blocks), the footprint and the metadata are reported.
+The footprint is the top of the heap for the list, and the pages of the arenas
+that the program wrote to for the buddy system, which it is assumed to do for
+every byte it asked for. Fragmentation is the peak footprint over the peak
+live bytes. The metadata is the headers of all blocks for the list, and the
+spacetrees and order maps of the arenas for the buddy system.
+
+Cache lines touched per call are an estimate. The buddy system touches the
+lines of the spacetree nodes on the path from the block to the root, and of
+the order map. The list touches the header of every block a walk passes, the
+list links it follows, a line per level of the large block tree, and the
+headers and footers of the block and its neighbours.
+
+usage: bench-sim trace
+*/
+
+#define LARGE_SIZE (4096)
+#define LINE (64)
+#define PAGE (4096)
+#define HDR_SIZE (8)
+#define NIL (UINT32_MAX)
+
+#define MAX(x, y) (x > y ? x : y)
+
+enum { ADDRESS_FIT, NEXT_FIT, FIRST_FIT, BEST_FIT };
+
+static const char *policy_names[] = {"address", "next", "first", "best"};
+
+static const size_t buddy_min_sizes[] = {16, 32, 64};
+static const size_t buddy_total_sizes[] = {1024*1024, 2*1024*1024, 4*1024*1024};
+static const size_t list_aligns[] = {8, 16, 32};
+
+typedef struct result_t {
+	size_t live;
+	size_t peak_live;
+	size_t allocated;
+	size_t peak_allocated;
+	size_t footprint;
+	size_t metadata;
+	uint64_t lines;
+	uint64_t calls;
+	uint64_t failed;
+} result_t;
+
+static void*
+xcalloc(size_t n, size_t size)
+{
+	void *ptr = calloc(n, size);
+	if (ptr == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	return ptr;
+}
+
+static size_t
+pow2_ceil(size_t x)
+{
+	size_t p = 1;
+	while (p < x) {
+		p *= 2;
+	}
+	return p;
+}
+
+static void
+result_alloc(result_t *r, size_t size, size_t block_size)
+{
+	r->live += size;
+	r->allocated += block_size;
+	r->peak_live = MAX(r->peak_live, r->live);
+	r->peak_allocated = MAX(r->peak_allocated, r->allocated);
+}
+
+static void
+result_free(result_t *r, size_t size, size_t block_size)
+{
+	r->live -= size;
+	r->allocated -= block_size;
+}
+
+typedef struct buddy_t {
+	size_t min_size;
+	size_t total_size;
+	size_t nblocks;
+	size_t narenas;
+	size_t cap;
+	uint32_t **trees;
+	uint8_t **touched;
+	size_t touched_pages;
+	size_t current;
+	// Per slot: arena << 32 | node, and the size asked for.
+	uint64_t *blocks;
+	size_t *sizes;
+} buddy_t;
+
+static size_t
+buddy_line(size_t idx)
+{
+	return idx * sizeof(uint32_t) / LINE;
+}
+
+// Returns the number of cache lines of the nodes from idx up to the root.
+static size_t
+buddy_path_lines(size_t idx)
+{
+	size_t lines = 1;
+	while (idx > 0) {
+		size_t p = (idx + 1) / 2 - 1;
+		lines += buddy_line(p) != buddy_line(idx);
+		idx = p;
+	}
+	return lines;
+}
+
+static void
+buddy_new_arena(buddy_t *b)
+{
+	if (b->narenas == b->cap) {
+		b->cap = MAX(b->cap * 2, 4);
+		b->trees = realloc(b->trees, b->cap * sizeof(uint32_t*));
+		b->touched = realloc(b->touched, b->cap * sizeof(uint8_t*));
+		if (b->trees == NULL || b->touched == NULL) {
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+	}
+	uint32_t *tree = xcalloc(2 * b->nblocks - 1, sizeof(uint32_t));
+	size_t size = b->total_size * 2;
+	for (size_t i = 0; i < 2 * b->nblocks - 1; i++) {
+		if (((i + 1) & i) == 0) {
+			size /= 2;
+		}
+		tree[i] = size;
+	}
+	b->trees[b->narenas] = tree;
+	b->touched[b->narenas] = xcalloc(b->total_size / PAGE + 1, 1);
+	b->narenas++;
+}
+
+// Returns the node of a block of size bytes in tree, or -1 if there is none.
+static ssize_t
+buddy_tree_alloc(buddy_t *b, uint32_t *tree, size_t size)
+{
+	if (tree[0] < size) {
+		return -1;
+	}
+	ssize_t idx = 0;
+	for (size_t block_size = b->total_size; block_size != size; block_size /= 2) {
+		idx = tree[2 * idx + 1] >= size ? 2 * idx + 1 : 2 * idx + 2;
+	}
+	tree[idx] = 0;
+	for (ssize_t i = idx; i > 0;) {
+		i = (i + 1) / 2 - 1;
+		tree[i] = MAX(tree[2 * i + 1], tree[2 * i + 2]);
+	}
+	return idx;
+}
+
+static void
+buddy_tree_free(uint32_t *tree, size_t idx, size_t size)
+{
+	tree[idx] = size;
+	while (idx > 0) {
+		size *= 2;
+		idx = (idx + 1) / 2 - 1;
+		uint32_t l = tree[2 * idx + 1];
+		uint32_t r = tree[2 * idx + 2];
+		tree[idx] = l + r == size ? size : MAX(l, r);
+	}
+}
+
+static size_t
+buddy_block_size(buddy_t *b, size_t size)
+{
+	return MAX(pow2_ceil(size), b->min_size);
+}
+
+static size_t
+buddy_node_size(buddy_t *b, size_t idx)
+{
+	return b->total_size >> (63 - __builtin_clzll(idx + 1));
+}
+
+static void
+buddy_malloc(buddy_t *b, result_t *r, uint64_t slot, size_t size)
+{
+	size_t bsize = buddy_block_size(b, size);
+	b->blocks[slot] = UINT64_MAX;
+	if (bsize > b->total_size) {
+		r->failed++;
+		return;
+	}
+	// Each arena tried costs a look at the root of its tree.
+	ssize_t idx = -1;
+	size_t a = b->current;
+	if (a < b->narenas) {
+		r->lines++;
+		idx = buddy_tree_alloc(b, b->trees[a], bsize);
+	}
+	for (size_t i = 0; idx < 0 && i < b->narenas; i++) {
+		if (i == b->current) {
+			continue;
+		}
+		r->lines++;
+		idx = buddy_tree_alloc(b, b->trees[i], bsize);
+		a = i;
+	}
+	if (idx < 0) {
+		buddy_new_arena(b);
+		a = b->narenas - 1;
+		idx = buddy_tree_alloc(b, b->trees[a], bsize);
+	}
+	b->current = a;
+	r->lines += buddy_path_lines(idx) + 1;
+
+	size_t offset = bsize * (idx + 1) - b->total_size;
+	for (size_t p = offset / PAGE; p <= (offset + MAX(size, 1) - 1) / PAGE; p++) {
+		if (!b->touched[a][p]) {
+			b->touched[a][p] = 1;
+			b->touched_pages++;
+		}
+	}
+	b->blocks[slot] = (uint64_t)a << 32 | (uint64_t)idx;
+	b->sizes[slot] = size;
+	result_alloc(r, size, bsize);
+	r->footprint = MAX(r->footprint, b->touched_pages * PAGE);
+	r->metadata = MAX(r->metadata, b->narenas * (b->nblocks * 2 * sizeof(uint32_t) + b->nblocks));
+}
+
+static void
+buddy_free(buddy_t *b, result_t *r, uint64_t slot)
+{
+	if (b->blocks[slot] == UINT64_MAX) {
+		return;
+	}
+	size_t a = b->blocks[slot] >> 32;
+	size_t idx = b->blocks[slot] & UINT32_MAX;
+	size_t bsize = buddy_node_size(b, idx);
+	buddy_tree_free(b->trees[a], idx, bsize);
+	r->lines += buddy_path_lines(idx) + 1;
+	result_free(r, b->sizes[slot], bsize);
+	b->blocks[slot] = UINT64_MAX;
+}
+
+static void
+buddy_run(const trace_t *t, size_t min_size, size_t total_size, result_t *r)
+{
+	buddy_t b;
+	memset(&b, 0, sizeof(b));
+	memset(r, 0, sizeof(*r));
+	b.min_size = min_size;
+	b.total_size = total_size;
+	b.nblocks = total_size / min_size;
+	b.blocks = xcalloc(t->nslots + 1, sizeof(uint64_t));
+	b.sizes = xcalloc(t->nslots + 1, sizeof(size_t));
+	for (size_t i = 0; i < t->nops; i++) {
+		const trace_op_t *o = &t->ops[i];
+		r->calls++;
+		switch (o->op) {
+		case TRACE_MALLOC:
+		case TRACE_CALLOC:
+			buddy_malloc(&b, r, o->slot, o->size);
+			break;
+		case TRACE_REALLOC:
+			if (b.blocks[o->old] != UINT64_MAX &&
+					buddy_node_size(&b, b.blocks[o->old] & UINT32_MAX) >= o->size) {
+				// Fits in place.
+				size_t bsize = buddy_node_size(&b, b.blocks[o->old] & UINT32_MAX);
+				result_free(r, b.sizes[o->old], bsize);
+				result_alloc(r, o->size, bsize);
+				b.blocks[o->slot] = b.blocks[o->old];
+				b.sizes[o->slot] = o->size;
+				b.blocks[o->old] = UINT64_MAX;
+				r->lines++;
+				break;
+			}
+			buddy_malloc(&b, r, o->slot, o->size);
+			buddy_free(&b, r, o->old);
+			break;
+		case TRACE_FREE:
+			buddy_free(&b, r, o->slot);
+			break;
+		}
+	}
+	for (size_t i = 0; i < b.narenas; i++) {
+		free(b.trees[i]);
+		free(b.touched[i]);
+	}
+	free(b.trees);
+	free(b.touched);
+	free(b.blocks);
+	free(b.sizes);
+}
+
+typedef struct node_t {
+	uint64_t off;
+	uint64_t size;
+	// Neighbours in address order.
+	uint32_t prev;
+	uint32_t next;
+	// Links of the free block index it is in.
+	uint32_t lprev;
+	uint32_t lnext;
+	uint8_t free;
+} node_t;
+
+typedef struct list_t {
+	int policy;
+	size_t align;
+	size_t min_block;
+	node_t *nodes;
+	size_t nnodes;
+	size_t cap;
+	uint32_t spare;
+	uint32_t first;
+	uint32_t last;
+	uint64_t top;
+	uint32_t rover;
+	size_t nblocks;
+	size_t small_free;
+	// FIRST_FIT list, or BEST_FIT bins, of small free blocks.
+	uint32_t small_list;
+	uint32_t *bins;
+	uint64_t *bin_map;
+	size_t nbins;
+	// Large free blocks, searched by best fit.
+	uint32_t large;
+	size_t nlarge;
+	// Per slot: node, and the size asked for.
+	uint32_t *blocks;
+	size_t *sizes;
+} list_t;
+
+static uint32_t
+node_new(list_t *l)
+{
+	uint32_t n;
+	if (l->spare != NIL) {
+		n = l->spare;
+		l->spare = l->nodes[n].next;
+	} else {
+		if (l->nnodes == l->cap) {
+			l->cap = MAX(l->cap * 2, 1024);
+			l->nodes = realloc(l->nodes, l->cap * sizeof(node_t));
+			if (l->nodes == NULL) {
+				fprintf(stderr, "out of memory\n");
+				exit(1);
+			}
+		}
+		n = l->nnodes++;
+	}
+	memset(&l->nodes[n], 0, sizeof(node_t));
+	l->nodes[n].prev = l->nodes[n].next = l->nodes[n].lprev = l->nodes[n].lnext = NIL;
+	l->nblocks++;
+	return n;
+}
+
+// Takes node n out of the address order and recycles it.
+static void
+node_delete(list_t *l, uint32_t n)
+{
+	node_t *x = &l->nodes[n];
+	if (x->prev != NIL) {
+		l->nodes[x->prev].next = x->next;
+	} else {
+		l->first = x->next;
+	}
+	if (x->next != NIL) {
+		l->nodes[x->next].prev = x->prev;
+	} else {
+		l->last = x->prev;
+	}
+	if (l->rover == n) {
+		l->rover = x->prev;
+	}
+	x->next = l->spare;
+	l->spare = n;
+	l->nblocks--;
+}
+
+static int
+list_linked(list_t *l)
+{
+	return l->policy == FIRST_FIT || l->policy == BEST_FIT;
+}
+
+static void
+link_push(list_t *l, uint32_t *head, uint32_t n)
+{
+	l->nodes[n].lprev = NIL;
+	l->nodes[n].lnext = *head;
+	if (*head != NIL) {
+		l->nodes[*head].lprev = n;
+	}
+	*head = n;
+}
+
+static void
+link_remove(list_t *l, uint32_t *head, uint32_t n)
+{
+	node_t *x = &l->nodes[n];
+	if (x->lprev != NIL) {
+		l->nodes[x->lprev].lnext = x->lnext;
+	} else {
+		*head = x->lnext;
+	}
+	if (x->lnext != NIL) {
+		l->nodes[x->lnext].lprev = x->lprev;
+	}
+}
+
+// Marks node n free and adds it to the index.
+static void
+index_insert(list_t *l, result_t *r, uint32_t n)
+{
+	node_t *x = &l->nodes[n];
+	x->free = 1;
+	if (x->size >= LARGE_SIZE) {
+		link_push(l, &l->large, n);
+		l->nlarge++;
+		r->lines += 64 - __builtin_clzll(l->nlarge);
+		return;
+	}
+	l->small_free++;
+	if (l->policy == FIRST_FIT) {
+		link_push(l, &l->small_list, n);
+		r->lines += 2;
+	} else if (l->policy == BEST_FIT) {
+		size_t i = x->size / l->align;
+		link_push(l, &l->bins[i], n);
+		l->bin_map[i / 64] |= (uint64_t)1 << (i % 64);
+		r->lines += 2;
+	}
+}
+
+// Takes the free node n out of the index.
+static void
+index_remove(list_t *l, result_t *r, uint32_t n)
+{
+	node_t *x = &l->nodes[n];
+	x->free = 0;
+	if (x->size >= LARGE_SIZE) {
+		r->lines += 64 - __builtin_clzll(l->nlarge);
+		link_remove(l, &l->large, n);
+		l->nlarge--;
+		return;
+	}
+	l->small_free--;
+	if (l->policy == FIRST_FIT) {
+		link_remove(l, &l->small_list, n);
+		r->lines += 2;
+	} else if (l->policy == BEST_FIT) {
+		size_t i = x->size / l->align;
+		link_remove(l, &l->bins[i], n);
+		if (l->bins[i] == NIL) {
+			l->bin_map[i / 64] &= ~((uint64_t)1 << (i % 64));
+		}
+		r->lines += 2;
+	}
+}
+
+// Counts the line of the header at off, unless the previous one was on it.
+static void
+walk_line(result_t *r, uint64_t off, uint64_t *line)
+{
+	if (off / LINE != *line) {
+		*line = off / LINE;
+		r->lines++;
+	}
+}
+
+// Returns a small free node of at least size bytes, or NIL.
+static uint32_t
+small_find(list_t *l, result_t *r, size_t size)
+{
+	if (l->small_free == 0) {
+		return NIL;
+	}
+	uint64_t line = UINT64_MAX;
+	switch (l->policy) {
+	case ADDRESS_FIT:
+		for (uint32_t n = l->first; n != NIL; n = l->nodes[n].next) {
+			walk_line(r, l->nodes[n].off, &line);
+			if (l->nodes[n].free && l->nodes[n].size >= size && l->nodes[n].size < LARGE_SIZE) {
+				return n;
+			}
+		}
+		break;
+	case NEXT_FIT: {
+		uint32_t start = l->rover != NIL ? l->rover : l->first;
+		uint32_t n = start;
+		do {
+			walk_line(r, l->nodes[n].off, &line);
+			if (l->nodes[n].free && l->nodes[n].size >= size && l->nodes[n].size < LARGE_SIZE) {
+				l->rover = n;
+				return n;
+			}
+			n = l->nodes[n].next != NIL ? l->nodes[n].next : l->first;
+		} while (n != start);
+		break;
+	}
+	case FIRST_FIT:
+		for (uint32_t n = l->small_list; n != NIL; n = l->nodes[n].lnext) {
+			r->lines++;
+			if (l->nodes[n].size >= size) {
+				return n;
+			}
+		}
+		break;
+	case BEST_FIT:
+		r->lines++;
+		for (size_t i = size / l->align; i < l->nbins; i++) {
+			if (l->bin_map[i / 64] == 0) {
+				i |= 63;
+				continue;
+			}
+			if (l->bins[i] != NIL) {
+				return l->bins[i];
+			}
+		}
+		break;
+	}
+	return NIL;
+}
+
+// Returns the smallest large free node of at least size bytes, or NIL.
+static uint32_t
+large_find(list_t *l, result_t *r, size_t size)
+{
+	if (l->nlarge == 0) {
+		return NIL;
+	}
+	// As deep as the AVL tree of ll.c would be.
+	r->lines += 64 - __builtin_clzll(l->nlarge);
+	uint32_t best = NIL;
+	for (uint32_t n = l->large; n != NIL; n = l->nodes[n].lnext) {
+		if (l->nodes[n].size >= size && (best == NIL || l->nodes[n].size < l->nodes[best].size)) {
+			best = n;
+		}
+	}
+	return best;
+}
+
+// Shrinks the used node n to size bytes, and indexes the rest as a free node.
+static void
+list_split(list_t *l, result_t *r, uint32_t n, size_t size)
+{
+	size_t rest = l->nodes[n].size - size;
+	if (rest < l->min_block) {
+		return;
+	}
+	uint32_t m = node_new(l);
+	node_t *x = &l->nodes[n];
+	node_t *y = &l->nodes[m];
+	x->size = size;
+	y->off = x->off + size;
+	y->size = rest;
+	y->prev = n;
+	y->next = x->next;
+	if (x->next != NIL) {
+		l->nodes[x->next].prev = m;
+	} else {
+		l->last = m;
+	}
+	x->next = m;
+	r->lines++;
+	index_insert(l, r, m);
+}
+
+static size_t
+list_block_size(list_t *l, size_t size)
+{
+	size = (size + HDR_SIZE + l->align - 1) & ~(l->align - 1);
+	return MAX(size, l->min_block);
+}
+
+static void
+list_malloc(list_t *l, result_t *r, uint64_t slot, size_t size)
+{
+	size_t need = list_block_size(l, size);
+	uint32_t n = NIL;
+	if (need < LARGE_SIZE) {
+		n = small_find(l, r, need);
+	}
+	if (n == NIL) {
+		n = large_find(l, r, need);
+	}
+	if (n != NIL) {
+		index_remove(l, r, n);
+		list_split(l, r, n, need);
+	} else {
+		n = node_new(l);
+		node_t *x = &l->nodes[n];
+		x->off = l->top;
+		x->size = need;
+		x->prev = l->last;
+		if (l->last != NIL) {
+			l->nodes[l->last].next = n;
+		} else {
+			l->first = n;
+		}
+		l->last = n;
+		l->top += need;
+	}
+	r->lines++;
+	l->blocks[slot] = n;
+	l->sizes[slot] = size;
+	result_alloc(r, size, l->nodes[n].size);
+	r->footprint = MAX(r->footprint, (l->top + PAGE - 1) / PAGE * PAGE);
+	r->metadata = MAX(r->metadata, l->nblocks * HDR_SIZE);
+}
+
+static void
+list_free(list_t *l, result_t *r, uint64_t slot)
+{
+	uint32_t n = l->blocks[slot];
+	result_free(r, l->sizes[slot], l->nodes[n].size);
+	// The header, the next header, and the footer before it.
+	r->lines += 3;
+	uint32_t next = l->nodes[n].next;
+	if (next != NIL && l->nodes[next].free) {
+		index_remove(l, r, next);
+		l->nodes[n].size += l->nodes[next].size;
+		node_delete(l, next);
+	}
+	uint32_t prev = l->nodes[n].prev;
+	if (prev != NIL && l->nodes[prev].free) {
+		index_remove(l, r, prev);
+		l->nodes[prev].size += l->nodes[n].size;
+		node_delete(l, n);
+		n = prev;
+	}
+	if (l->nodes[n].next == NIL) {
+		// Back to the top of the heap.
+		l->top = l->nodes[n].off;
+		node_delete(l, n);
+		return;
+	}
+	index_insert(l, r, n);
+}
+
+static void
+list_run(const trace_t *t, int policy, size_t align, result_t *r)
+{
+	list_t l;
+	memset(&l, 0, sizeof(l));
+	memset(r, 0, sizeof(*r));
+	l.policy = policy;
+	l.align = align;
+	// A free block holds a footer, and for the linked policies two links.
+	l.min_block = list_block_size(&l, list_linked(&l) ? 2 * sizeof(void*) : 1);
+	l.spare = l.first = l.last = l.rover = NIL;
+	l.small_list = l.large = NIL;
+	l.nbins = LARGE_SIZE / align;
+	l.bins = xcalloc(l.nbins, sizeof(uint32_t));
+	memset(l.bins, 0xff, l.nbins * sizeof(uint32_t));
+	l.bin_map = xcalloc(l.nbins / 64 + 1, sizeof(uint64_t));
+	l.blocks = xcalloc(t->nslots + 1, sizeof(uint32_t));
+	l.sizes = xcalloc(t->nslots + 1, sizeof(size_t));
+	for (size_t i = 0; i < t->nops; i++) {
+		const trace_op_t *o = &t->ops[i];
+		r->calls++;
+		switch (o->op) {
+		case TRACE_MALLOC:
+		case TRACE_CALLOC:
+			list_malloc(&l, r, o->slot, o->size);
+			break;
+		case TRACE_REALLOC: {
+			uint32_t n = l.blocks[o->old];
+			if (l.nodes[n].size - HDR_SIZE >= o->size) {
+				// Fits in place.
+				result_free(r, l.sizes[o->old], l.nodes[n].size);
+				result_alloc(r, o->size, l.nodes[n].size);
+				l.blocks[o->slot] = n;
+				l.sizes[o->slot] = o->size;
+				r->lines++;
+				break;
+			}
+			list_malloc(&l, r, o->slot, o->size);
+			list_free(&l, r, o->old);
+			break;
+		}
+		case TRACE_FREE:
+			list_free(&l, r, o->slot);
+			break;
+		}
+	}
+	free(l.nodes);
+	free(l.bins);
+	free(l.bin_map);
+	free(l.blocks);
+	free(l.sizes);
+}
+
+static void
+report(const char *model, const char *params, const result_t *r)
+{
+	printf("%6s %-22s %10zu %10zu %10zu %6.2f %10zu %8.2f %8lu\n", model, params,
+		r->peak_live / 1024, r->peak_allocated / 1024, r->footprint / 1024,
+		r->peak_live > 0 ? (double)r->footprint / r->peak_live : 0,
+		r->metadata / 1024, r->calls > 0 ? (double)r->lines / r->calls : 0,
+		(unsigned long)r->failed);
+	fflush(stdout);
+}
+
+int
+main(int argc, char **argv)
+{
+	if (argc < 2) {
+		fprintf(stderr, "usage: bench-sim trace\n");
+		return 1;
+	}
+	trace_t t;
+	if (trace_load(argv[1], &t) != 0) {
+		return 1;
+	}
+
+	printf("%6s %-22s %10s %10s %10s %6s %10s %8s %8s\n", "model", "params",
+		"live_kb", "alloc_kb", "fp_kb", "frag", "meta_kb", "lines", "failed");
+	char params[64];
+	result_t r;
+	for (size_t i = 0; i < sizeof(buddy_min_sizes) / sizeof(buddy_min_sizes[0]); i++) {
+		for (size_t j = 0; j < sizeof(buddy_total_sizes) / sizeof(buddy_total_sizes[0]); j++) {
+			buddy_run(&t, buddy_min_sizes[i], buddy_total_sizes[j], &r);
+			snprintf(params, sizeof(params), "min=%zu total=%zuk", buddy_min_sizes[i],
+				buddy_total_sizes[j] / 1024);
+			report("buddy", params, &r);
+		}
+	}
+	for (int p = ADDRESS_FIT; p <= BEST_FIT; p++) {
+		for (size_t i = 0; i < sizeof(list_aligns) / sizeof(list_aligns[0]); i++) {
+			list_run(&t, p, list_aligns[i], &r);
+			snprintf(params, sizeof(params), "%s align=%zu", policy_names[p], list_aligns[i]);
+			report("list", params, &r);
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,175 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../smalloc.h"
+
+/*
+Footprint under skewed per-thread load.
+
+In every phase a single thread is busy: it allocates a working set of random
+blocks, writes to all of them, and frees them again. All other threads are
+idle. The busy thread changes every phase, so each thread allocates heavily
+and then goes idle. Phases are idle_ms apart. After every phase the resident set
+size of the process is reported, and with smalloc also the number of arenas in
+use.
+
+usage: bench-skew [threads] [phases] [working_set_kb] [idle_ms]
+*/
+
+#define MIN_SIZE (1024)
+#define MAX_SIZE (64*1024)
+
+// Not there when linked with another allocator.
+#pragma weak smalloc_lock_stats
+
+typedef struct worker_t {
+	pthread_t thread;
+	size_t id;
+} worker_t;
+
+static pthread_barrier_t barrier;
+static size_t nthreads;
+static size_t nphases;
+static size_t working_set;
+static size_t idle_ms;
+
+static uint64_t
+rng(uint64_t *state)
+{
+	// https://en.wikipedia.org/wiki/Xorshift#xorshift*
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return *state * 0x2545F4914F6CDD1DULL;
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t
+rss(void)
+{
+	char buf[128];
+	int fd = open("/proc/self/statm", O_RDONLY);
+	if (fd < 0) {
+		return 0;
+	}
+	ssize_t n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0) {
+		return 0;
+	}
+	buf[n] = '\0';
+	unsigned long size, resident;
+	if (sscanf(buf, "%lu %lu", &size, &resident) != 2) {
+		return 0;
+	}
+	return resident * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+static void
+burst(uint64_t *seed)
+{
+	size_t max_blocks = working_set / MIN_SIZE + 1;
+	void **blocks = malloc(max_blocks * sizeof(void*));
+	if (blocks == NULL) {
+		fprintf(stderr, "malloc failed\n");
+		exit(1);
+	}
+	size_t n = 0;
+	for (size_t total = 0; total < working_set; n++) {
+		size_t size = MIN_SIZE + rng(seed) % (MAX_SIZE - MIN_SIZE);
+		blocks[n] = malloc(size);
+		if (blocks[n] == NULL) {
+			fprintf(stderr, "malloc(%zu) failed\n", size);
+			exit(1);
+		}
+		memset(blocks[n], 1, size);
+		total += size;
+	}
+	for (size_t i = 0; i < n; i++) {
+		free(blocks[i]);
+	}
+	free(blocks);
+}
+
+static void*
+worker(void *arg)
+{
+	worker_t *w = arg;
+	uint64_t seed = w->id + 1;
+	for (size_t phase = 0; phase < nphases; phase++) {
+		pthread_barrier_wait(&barrier);
+		if (phase % nthreads == w->id) {
+			burst(&seed);
+		}
+		pthread_barrier_wait(&barrier);
+	}
+	return NULL;
+}
+
+int
+main(int argc, char **argv)
+{
+	nthreads = argc > 1 ? strtoull(argv[1], NULL, 10) : 8;
+	nphases = argc > 2 ? strtoull(argv[2], NULL, 10) : 32;
+	working_set = (argc > 3 ? strtoull(argv[3], NULL, 10) : 3072) * 1024;
+	idle_ms = argc > 4 ? strtoull(argv[4], NULL, 10) : 20;
+	if (nthreads == 0) {
+		fprintf(stderr, "usage: bench-skew [threads] [phases] [working_set_kb] [idle_ms]\n");
+		return 1;
+	}
+
+	worker_t *workers = calloc(nthreads, sizeof(worker_t));
+	if (workers == NULL) {
+		return 1;
+	}
+	pthread_barrier_init(&barrier, NULL, nthreads + 1);
+	for (size_t i = 0; i < nthreads; i++) {
+		workers[i].id = i;
+		if (pthread_create(&workers[i].thread, NULL, worker, &workers[i]) != 0) {
+			fprintf(stderr, "pthread_create failed\n");
+			return 1;
+		}
+	}
+
+	printf("%8s %8s %10s %8s\n", "phase", "thread", "rss_kb", "arenas");
+	size_t peak_rss = 0;
+	double start = now();
+	for (size_t phase = 0; phase < nphases; phase++) {
+		pthread_barrier_wait(&barrier);
+		pthread_barrier_wait(&barrier);
+		struct timespec idle = {idle_ms / 1000, (long)(idle_ms % 1000) * 1000000};
+		nanosleep(&idle, NULL);
+		size_t r = rss();
+		peak_rss = r > peak_rss ? r : peak_rss;
+		printf("%8zu %8zu %10zu", phase, phase % nthreads, r / 1024);
+		if (smalloc_lock_stats != NULL) {
+			printf(" %8zu", smalloc_lock_stats(NULL, 0));
+		}
+		printf("\n");
+	}
+	double elapsed = now() - start;
+
+	for (size_t i = 0; i < nthreads; i++) {
+		pthread_join(workers[i].thread, NULL);
+	}
+	pthread_barrier_destroy(&barrier);
+	free(workers);
+
+	printf("\n");
+	printf("elapsed_s:      %.3f\n", elapsed);
+	printf("peak_rss_kb:    %zu\n", peak_rss / 1024);
+	return 0;
+}
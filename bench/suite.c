@@ -0,0 +1,228 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "perf.h"
+
+/*
+Single-threaded benchmark suite.
+
+Runs a fixed set of workloads against whichever malloc the binary is linked
+with, and prints one CSV row per workload and size:
+
+  pair      malloc() and free() of one block, over and over.
+  lifo      BATCH blocks allocated, then freed newest first.
+  fifo      BATCH blocks allocated, then freed oldest first.
+  churn     the block in a random one of NSLOTS slots is replaced by a block
+            of random size up to the given size.
+  realloc2  a block grown from MIN_SIZE to the given size by doubling.
+  realloc+  a block grown from MIN_SIZE to the given size in steps of STEP.
+
+The columns are the allocator label given on the command line, the workload,
+the size, the number of operations (every malloc, free and realloc counts as
+one), the elapsed time and the operations per second. Runs of different builds
+can be concatenated and compared.
+
+They are followed by the L1 data cache, last level cache and data TLB read
+misses and the branch mispredictions per operation, counted with
+perf_event_open() over each row, see perf.h. The columns of counters that are
+not available are left empty.
+
+usage: bench-suite [label] [ops_per_row]
+*/
+
+#define MIN_SIZE (16)
+#define BATCH (1024)
+#define NSLOTS (1024)
+#define STEP (64)
+
+static const size_t sizes[] = {16, 32, 64, 128, 256, 512, 1024, 4096, 16384, 65536};
+static const size_t realloc_sizes[] = {4096, 65536, 1024*1024};
+
+static void *blocks[BATCH > NSLOTS ? BATCH : NSLOTS];
+
+static uint64_t
+rng(uint64_t *state)
+{
+	// https://en.wikipedia.org/wiki/Xorshift#xorshift*
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return *state * 0x2545F4914F6CDD1DULL;
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void*
+xmalloc(size_t size)
+{
+	char *ptr = malloc(size);
+	if (ptr == NULL) {
+		fprintf(stderr, "malloc(%zu) failed\n", size);
+		exit(1);
+	}
+	// Volatile, so that the store is not dropped when the block is freed
+	// right away, and the block is touched in every workload.
+	*(volatile char*)(ptr) = 1;
+	return ptr;
+}
+
+static uint64_t
+run_pair(size_t size, uint64_t ops)
+{
+	uint64_t i = 0;
+	for (; i < ops; i += 2) {
+		free(xmalloc(size));
+	}
+	return i;
+}
+
+static uint64_t
+run_lifo(size_t size, uint64_t ops)
+{
+	uint64_t n = 0;
+	while (n < ops) {
+		for (size_t i = 0; i < BATCH; i++) {
+			blocks[i] = xmalloc(size);
+		}
+		for (size_t i = BATCH; i > 0; i--) {
+			free(blocks[i - 1]);
+		}
+		n += 2 * BATCH;
+	}
+	return n;
+}
+
+static uint64_t
+run_fifo(size_t size, uint64_t ops)
+{
+	uint64_t n = 0;
+	while (n < ops) {
+		for (size_t i = 0; i < BATCH; i++) {
+			blocks[i] = xmalloc(size);
+		}
+		for (size_t i = 0; i < BATCH; i++) {
+			free(blocks[i]);
+		}
+		n += 2 * BATCH;
+	}
+	return n;
+}
+
+static uint64_t
+run_churn(size_t size, uint64_t ops)
+{
+	uint64_t seed = size;
+	memset(blocks, 0, sizeof(blocks));
+	uint64_t n = 0;
+	for (; n < ops; n += 2) {
+		size_t slot = rng(&seed) % NSLOTS;
+		free(blocks[slot]);
+		blocks[slot] = xmalloc(MIN_SIZE + rng(&seed) % (size - MIN_SIZE + 1));
+	}
+	for (size_t i = 0; i < NSLOTS; i++) {
+		free(blocks[i]);
+	}
+	return n + NSLOTS;
+}
+
+static uint64_t
+run_realloc(size_t size, uint64_t ops, int doubling)
+{
+	uint64_t n = 0;
+	while (n < ops) {
+		char *ptr = xmalloc(MIN_SIZE);
+		size_t cur = MIN_SIZE;
+		while (cur < size) {
+			cur = doubling ? cur * 2 : cur + STEP;
+			ptr = realloc(ptr, cur);
+			if (ptr == NULL) {
+				fprintf(stderr, "realloc(%zu) failed\n", cur);
+				exit(1);
+			}
+			ptr[cur - 1] = 1;
+			n++;
+		}
+		free(ptr);
+		n += 2;
+	}
+	return n;
+}
+
+static perf_t perf;
+
+static void
+report(const char *label, const char *workload, size_t size, uint64_t ops, double elapsed)
+{
+	printf("%s,%s,%zu,%lu,%.6f,%.0f", label, workload, size, (unsigned long)ops,
+		elapsed, ops / elapsed);
+	for (size_t i = 0; i < PERF_EVENTS; i++) {
+		if (perf_count(&perf, i) < 0) {
+			printf(",");
+		} else {
+			printf(",%.4f", (double)perf_count(&perf, i) / ops);
+		}
+	}
+	printf("\n");
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *label = argc > 1 ? argv[1] : "malloc";
+	uint64_t ops = argc > 2 ? strtoull(argv[2], NULL, 10) : 1000000;
+	if (ops == 0) {
+		fprintf(stderr, "usage: bench-suite [label] [ops_per_row]\n");
+		return 1;
+	}
+
+	if (perf_open(&perf) == 0) {
+		fprintf(stderr, "no hardware counters, their columns are left empty\n");
+	}
+	printf("allocator,workload,size,ops,seconds,ops_per_sec");
+	for (size_t i = 0; i < PERF_EVENTS; i++) {
+		printf(",%s_per_op", perf_events[i].name);
+	}
+	printf("\n");
+	static const struct {
+		const char *name;
+		uint64_t (*run)(size_t, uint64_t);
+	} workloads[] = {
+		{"pair", run_pair},
+		{"lifo", run_lifo},
+		{"fifo", run_fifo},
+		{"churn", run_churn},
+	};
+	for (size_t w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++) {
+		for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+			perf_start(&perf);
+			double start = now();
+			uint64_t n = workloads[w].run(sizes[s], ops);
+			double elapsed = now() - start;
+			perf_stop(&perf);
+			report(label, workloads[w].name, sizes[s], n, elapsed);
+		}
+	}
+	for (int doubling = 1; doubling >= 0; doubling--) {
+		for (size_t s = 0; s < sizeof(realloc_sizes) / sizeof(realloc_sizes[0]); s++) {
+			// Growing in steps takes size/STEP reallocs per block, so a
+			// row would otherwise take far longer than the others.
+			uint64_t n = doubling ? ops : ops / 8;
+			perf_start(&perf);
+			double start = now();
+			n = run_realloc(realloc_sizes[s], n, doubling);
+			double elapsed = now() - start;
+			perf_stop(&perf);
+			report(label, doubling ? "realloc2" : "realloc+", realloc_sizes[s], n, elapsed);
+		}
+	}
+	return 0;
+}
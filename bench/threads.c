@@ -0,0 +1,180 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../smalloc.h"
+
+/*
+Multithreaded throughput benchmark.
+
+Every thread owns NSLOTS slots and repeatedly replaces the block in a random
+slot with a new block of random size, so each operation is one free and one
+malloc. The same total number of operations is run with 1, 2, 4, ... threads up
+to the given maximum, and the throughput of each run is reported. Before
+freeing their slots, the threads wait until the resident set size of the
+process is sampled, which includes the blocks held in thread or CPU caches.
+
+Linked with smalloc, the contended lock acquires of each run and the time spent
+waiting in them are reported too.
+
+usage: bench-threads [max_threads] [ops_per_thread]
+*/
+
+#define MAX(x, y) (x > y ? x : y)
+
+#define MAX_LOCKS (64)
+
+// Not there when linked with another allocator.
+#pragma weak smalloc_lock_stats
+
+#define NSLOTS (256)
+#define MIN_SIZE (16)
+#define MAX_SIZE (1024)
+
+static pthread_barrier_t barrier;
+
+typedef struct worker_t {
+	pthread_t thread;
+	uint64_t seed;
+	uint64_t ops;
+} worker_t;
+
+static uint64_t
+rng(uint64_t *state)
+{
+	// https://en.wikipedia.org/wiki/Xorshift#xorshift*
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return *state * 0x2545F4914F6CDD1DULL;
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t
+rss(void)
+{
+	char buf[128];
+	int fd = open("/proc/self/statm", O_RDONLY);
+	if (fd < 0) {
+		return 0;
+	}
+	ssize_t n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0) {
+		return 0;
+	}
+	buf[n] = '\0';
+	unsigned long size, resident;
+	if (sscanf(buf, "%lu %lu", &size, &resident) != 2) {
+		return 0;
+	}
+	return resident * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+// Sums the statistics of all locks of the allocator.
+static void
+lock_totals(smalloc_lock_stats_t *total)
+{
+	smalloc_lock_stats_t stats[MAX_LOCKS];
+	memset(total, 0, sizeof(*total));
+	if (smalloc_lock_stats == NULL) {
+		return;
+	}
+	size_t n = smalloc_lock_stats(stats, MAX_LOCKS);
+	for (size_t i = 0; i < n && i < MAX_LOCKS; i++) {
+		total->acquires += stats[i].acquires;
+		total->contended += stats[i].contended;
+		total->wait_ns += stats[i].wait_ns;
+	}
+}
+
+static void*
+worker(void *arg)
+{
+	worker_t *w = arg;
+	void *slots[NSLOTS] = {0};
+	for (uint64_t i = 0; i < w->ops; i++) {
+		uint64_t r = rng(&w->seed);
+		size_t slot = r % NSLOTS;
+		size_t size = MIN_SIZE + (r >> 32) % (MAX_SIZE - MIN_SIZE);
+		free(slots[slot]);
+		slots[slot] = malloc(size);
+		if (slots[slot] == NULL) {
+			fprintf(stderr, "malloc(%zu) failed\n", size);
+			exit(1);
+		}
+		*(char *)slots[slot] = (char)i;
+	}
+	pthread_barrier_wait(&barrier);
+	pthread_barrier_wait(&barrier);
+	for (size_t i = 0; i < NSLOTS; i++) {
+		free(slots[i]);
+	}
+	return NULL;
+}
+
+int
+main(int argc, char **argv)
+{
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t max_threads = argc > 1 ? strtoull(argv[1], NULL, 10) : (size_t)MAX(2 * ncpu, 4);
+	uint64_t ops = argc > 2 ? strtoull(argv[2], NULL, 10) : 1000000;
+
+	worker_t *workers = calloc(max_threads, sizeof(worker_t));
+	if (workers == NULL) {
+		return 1;
+	}
+
+	printf("%8s %12s %10s %14s %10s", "threads", "ops", "elapsed_s", "ops_per_s", "rss_kb");
+	if (smalloc_lock_stats != NULL) {
+		printf(" %12s %12s %10s", "acquires", "contended", "wait_ms");
+	}
+	printf("\n");
+	for (size_t n = 1; n <= max_threads; n *= 2) {
+		pthread_barrier_init(&barrier, NULL, n + 1);
+		smalloc_lock_stats_t before, after;
+		lock_totals(&before);
+		double start = now();
+		for (size_t i = 0; i < n; i++) {
+			workers[i].seed = i + 1;
+			workers[i].ops = ops;
+			if (pthread_create(&workers[i].thread, NULL, worker, &workers[i]) != 0) {
+				fprintf(stderr, "pthread_create failed\n");
+				return 1;
+			}
+		}
+		pthread_barrier_wait(&barrier);
+		size_t resident = rss();
+		pthread_barrier_wait(&barrier);
+		for (size_t i = 0; i < n; i++) {
+			pthread_join(workers[i].thread, NULL);
+		}
+		double elapsed = now() - start;
+		pthread_barrier_destroy(&barrier);
+		lock_totals(&after);
+		printf("%8zu %12lu %10.3f %14.0f %10zu", n, (unsigned long)(n * ops),
+			elapsed, n * ops / elapsed, resident / 1024);
+		if (smalloc_lock_stats != NULL) {
+			printf(" %12lu %12lu %10.1f",
+				(unsigned long)(after.acquires - before.acquires),
+				(unsigned long)(after.contended - before.contended),
+				(after.wait_ns - before.wait_ns) / 1e6);
+		}
+		printf("\n");
+		fflush(stdout);
+	}
+	free(workers);
+	return 0;
+}
@@ -0,0 +1,253 @@
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+/*
+Allocation trace recorder.
+
+Built as a shared library and loaded with LD_PRELOAD, it records every
+malloc(), calloc(), realloc() and free() of the program to the file named by
+SMALLOC_TRACE, smalloc.trace by default, and passes the call on to the next
+allocator. See trace.h for the format.
+
+Each call and its record are made under a single lock, so that a block freed
+by one thread and handed out again to another shows up in that order. This
+serializes the program's allocations while it is traced. Records are buffered
+and written when the buffer fills up and when the program exits. Calls made
+after that, and calls of a forked child, are not recorded.
+
+dlsym() may allocate before the next allocator is known. Those requests are
+served from a small static buffer, and are not recorded.
+
+usage: SMALLOC_TRACE=file LD_PRELOAD=./trace.so program
+*/
+
+#define BUF_RECS (4096)
+#define BOOTSTRAP_SIZE (4096)
+
+static void *(*next_malloc)(size_t);
+static void *(*next_calloc)(size_t, size_t);
+static void *(*next_realloc)(void*, size_t);
+static void (*next_free)(void*);
+
+static int initializing = 0;
+static char bootstrap[BOOTSTRAP_SIZE] __attribute__((aligned(16)));
+static size_t bootstrap_used = 0;
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static int fd = -1;
+static uint64_t start_ns;
+static trace_rec_t buf[BUF_RECS];
+static size_t nbuf = 0;
+
+static __thread uint32_t thread_id __attribute__((tls_model("initial-exec"))) = 0;
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+is_bootstrap(void *ptr)
+{
+	return (char*)(ptr) >= bootstrap && (char*)(ptr) < bootstrap + BOOTSTRAP_SIZE;
+}
+
+static void*
+bootstrap_alloc(size_t size)
+{
+	size = (size + 15) & ~(size_t)15;
+	if (bootstrap_used + size > BOOTSTRAP_SIZE) {
+		return NULL;
+	}
+	void *ptr = bootstrap + bootstrap_used;
+	bootstrap_used += size;
+	return ptr;
+}
+
+static void
+trace_init(void)
+{
+	if (next_free != NULL || initializing) {
+		return;
+	}
+	initializing = 1;
+	// ISO C has no conversion from void* to a function pointer, POSIX
+	// suggests this one.
+	*(void**)(&next_malloc) = dlsym(RTLD_NEXT, "malloc");
+	*(void**)(&next_calloc) = dlsym(RTLD_NEXT, "calloc");
+	*(void**)(&next_realloc) = dlsym(RTLD_NEXT, "realloc");
+	*(void**)(&next_free) = dlsym(RTLD_NEXT, "free");
+	initializing = 0;
+
+	const char *path = getenv("SMALLOC_TRACE");
+	fd = open(path != NULL ? path : "smalloc.trace", O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd >= 0 && write(fd, TRACE_MAGIC, TRACE_MAGIC_SIZE) != TRACE_MAGIC_SIZE) {
+		close(fd);
+		fd = -1;
+	}
+	start_ns = now_ns();
+}
+
+// Writes out the buffered records. Must hold trace_lock.
+static void
+trace_flush(void)
+{
+	char *p = (char*)buf;
+	size_t left = nbuf * sizeof(trace_rec_t);
+	while (fd >= 0 && left > 0) {
+		ssize_t n = write(fd, p, left);
+		if (n <= 0) {
+			close(fd);
+			fd = -1;
+			break;
+		}
+		p += n;
+		left -= n;
+	}
+	nbuf = 0;
+}
+
+// Buffers a record. Must hold trace_lock.
+static void
+trace_record(uint32_t op, void *ptr, void *old, size_t size)
+{
+	if (fd < 0) {
+		return;
+	}
+	if (thread_id == 0) {
+		thread_id = (uint32_t)syscall(SYS_gettid);
+	}
+	trace_rec_t *r = &buf[nbuf++];
+	r->time_ns = now_ns() - start_ns;
+	r->ptr = (uintptr_t)ptr;
+	r->old = (uintptr_t)old;
+	r->size = size;
+	r->thread = thread_id;
+	r->op = op;
+	if (nbuf == BUF_RECS) {
+		trace_flush();
+	}
+}
+
+void*
+malloc(size_t size)
+{
+	trace_init();
+	if (next_malloc == NULL) {
+		return bootstrap_alloc(size);
+	}
+	pthread_mutex_lock(&trace_lock);
+	void *ptr = next_malloc(size);
+	if (ptr != NULL) {
+		trace_record(TRACE_MALLOC, ptr, NULL, size);
+	}
+	pthread_mutex_unlock(&trace_lock);
+	return ptr;
+}
+
+void*
+calloc(size_t nmemb, size_t size)
+{
+	trace_init();
+	if (next_calloc == NULL) {
+		// Static memory is zeroed already.
+		return bootstrap_alloc(nmemb * size);
+	}
+	pthread_mutex_lock(&trace_lock);
+	void *ptr = next_calloc(nmemb, size);
+	if (ptr != NULL) {
+		trace_record(TRACE_CALLOC, ptr, NULL, nmemb * size);
+	}
+	pthread_mutex_unlock(&trace_lock);
+	return ptr;
+}
+
+void*
+realloc(void *old, size_t size)
+{
+	trace_init();
+	if (next_realloc == NULL || is_bootstrap(old)) {
+		void *ptr = malloc(size);
+		if (ptr != NULL && old != NULL) {
+			size_t room = (size_t)(bootstrap + BOOTSTRAP_SIZE - (char*)(old));
+			memcpy(ptr, old, size < room ? size : room);
+		}
+		return ptr;
+	}
+	pthread_mutex_lock(&trace_lock);
+	void *ptr = next_realloc(old, size);
+	if (ptr != NULL || size == 0) {
+		trace_record(TRACE_REALLOC, ptr, old, size);
+	}
+	pthread_mutex_unlock(&trace_lock);
+	return ptr;
+}
+
+void
+free(void *ptr)
+{
+	trace_init();
+	if (ptr == NULL || is_bootstrap(ptr)) {
+		return;
+	}
+	pthread_mutex_lock(&trace_lock);
+	trace_record(TRACE_FREE, ptr, NULL, 0);
+	next_free(ptr);
+	pthread_mutex_unlock(&trace_lock);
+}
+
+static void
+fork_prepare(void)
+{
+	pthread_mutex_lock(&trace_lock);
+}
+
+static void
+fork_parent(void)
+{
+	pthread_mutex_unlock(&trace_lock);
+}
+
+// The child drops the records of its parent and records nothing itself.
+static void
+fork_child(void)
+{
+	nbuf = 0;
+	if (fd >= 0) {
+		close(fd);
+	}
+	fd = -1;
+	pthread_mutex_unlock(&trace_lock);
+}
+
+__attribute__((constructor)) static void
+trace_start(void)
+{
+	trace_init();
+	pthread_atfork(fork_prepare, fork_parent, fork_child);
+}
+
+__attribute__((destructor)) static void
+trace_stop(void)
+{
+	pthread_mutex_lock(&trace_lock);
+	trace_flush();
+	if (fd >= 0) {
+		close(fd);
+	}
+	fd = -1;
+	pthread_mutex_unlock(&trace_lock);
+}
@@ -0,0 +1,215 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+Format of the allocation traces written by trace.so and read by bench-replay
+and bench-sim.
+
+A trace is TRACE_MAGIC followed by one trace_rec_t per call, in the order the
+calls were made. Calls of all threads are recorded under a single lock, so the
+order is one the program could have run in. Pointers are recorded as they
+were, and only serve to tell which free() goes with which malloc().
+
+trace_load() turns a trace into a list of operations on numbered slots, one
+slot per allocation, so that a call can be replayed with an array lookup rather
+than a search for the recorded pointer. Frees of pointers the trace never
+allocated are dropped, and so are failed calls. Memory for all of it is mapped
+rather than allocated, so that it does not count towards the allocator under
+test.
+*/
+
+#define TRACE_MAGIC "smtrace1"
+#define TRACE_MAGIC_SIZE (8)
+
+enum {
+	TRACE_MALLOC,
+	TRACE_CALLOC,
+	TRACE_REALLOC,
+	TRACE_FREE,
+};
+
+typedef struct trace_rec_t {
+	// Time of the call since the trace started, in nanoseconds.
+	uint64_t time_ns;
+	// The pointer returned, or the one freed.
+	uint64_t ptr;
+	// The pointer passed to realloc().
+	uint64_t old;
+	// The size asked for, nmemb*size for calloc().
+	uint64_t size;
+	uint32_t thread;
+	uint32_t op;
+} trace_rec_t;
+
+#define TRACE_NONE (UINT64_MAX)
+
+typedef struct trace_op_t {
+	uint32_t op;
+	// Slot of the block allocated, or of the block freed.
+	uint64_t slot;
+	// Slot of the block passed to realloc(), or TRACE_NONE.
+	uint64_t old;
+	uint64_t size;
+} trace_op_t;
+
+typedef struct trace_t {
+	trace_op_t *ops;
+	size_t nops;
+	size_t nrecs;
+	uint64_t nslots;
+} trace_t;
+
+typedef struct trace_entry_t {
+	uint64_t ptr;
+	uint64_t slot;
+} trace_entry_t;
+
+// Recorded pointers of the live blocks, to their slots, in an open-addressing
+// table with tombstones.
+typedef struct trace_table_t {
+	trace_entry_t *entries;
+	size_t mask;
+} trace_table_t;
+
+#define TRACE_EMPTY (0)
+#define TRACE_TOMBSTONE (1)
+
+// Returns size bytes of zeroed memory that is not from the allocator, or NULL.
+static inline void*
+trace_map(size_t size)
+{
+	void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	return ptr == MAP_FAILED ? NULL : ptr;
+}
+
+static inline size_t
+trace_hash(uint64_t ptr)
+{
+	return (size_t)((ptr >> 4) * 0x9E3779B97F4A7C15ULL);
+}
+
+static inline void
+trace_table_insert(trace_table_t *t, uint64_t ptr, uint64_t slot)
+{
+	size_t i = trace_hash(ptr) & t->mask;
+	while (t->entries[i].ptr != TRACE_EMPTY && t->entries[i].ptr != TRACE_TOMBSTONE) {
+		i = (i + 1) & t->mask;
+	}
+	t->entries[i].ptr = ptr;
+	t->entries[i].slot = slot;
+}
+
+// Removes ptr and returns its slot, or TRACE_NONE if it is not there.
+static inline uint64_t
+trace_table_remove(trace_table_t *t, uint64_t ptr)
+{
+	for (size_t i = trace_hash(ptr) & t->mask; t->entries[i].ptr != TRACE_EMPTY; i = (i + 1) & t->mask) {
+		if (t->entries[i].ptr == ptr) {
+			t->entries[i].ptr = TRACE_TOMBSTONE;
+			return t->entries[i].slot;
+		}
+	}
+	return TRACE_NONE;
+}
+
+// Turns the n records into operations on slots in t.
+static inline void
+trace_prepare(const trace_rec_t *recs, size_t n, trace_t *t, trace_table_t *table)
+{
+	size_t k = 0;
+	uint64_t slot = 0;
+	for (size_t i = 0; i < n; i++) {
+		const trace_rec_t *r = &recs[i];
+		trace_op_t *o = &t->ops[k];
+		o->op = r->op;
+		o->size = r->size;
+		o->slot = TRACE_NONE;
+		o->old = TRACE_NONE;
+		switch (r->op) {
+		case TRACE_MALLOC:
+		case TRACE_CALLOC:
+			o->slot = slot++;
+			trace_table_insert(table, r->ptr, o->slot);
+			break;
+		case TRACE_REALLOC:
+			if (r->old != 0) {
+				o->old = trace_table_remove(table, r->old);
+			}
+			if (r->ptr == 0) {
+				// realloc(ptr, 0) freed the block.
+				if (o->old == TRACE_NONE) {
+					continue;
+				}
+				o->op = TRACE_FREE;
+				o->slot = o->old;
+				o->old = TRACE_NONE;
+				break;
+			}
+			o->slot = slot++;
+			trace_table_insert(table, r->ptr, o->slot);
+			if (o->old == TRACE_NONE) {
+				o->op = TRACE_MALLOC;
+			}
+			break;
+		case TRACE_FREE:
+			o->slot = trace_table_remove(table, r->ptr);
+			if (o->slot == TRACE_NONE) {
+				continue;
+			}
+			break;
+		default:
+			continue;
+		}
+		k++;
+	}
+	t->nops = k;
+	t->nslots = slot;
+}
+
+// Reads the trace at path into t. Returns 0, or -1 with a message on stderr.
+static inline int
+trace_load(const char *path, trace_t *t)
+{
+	int fd = open(path, O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) != 0 || st.st_size < TRACE_MAGIC_SIZE) {
+		fprintf(stderr, "can't read %s\n", path);
+		return -1;
+	}
+	char *file = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (file == MAP_FAILED || memcmp(file, TRACE_MAGIC, TRACE_MAGIC_SIZE) != 0) {
+		fprintf(stderr, "%s is not a trace\n", path);
+		return -1;
+	}
+	t->nrecs = (st.st_size - TRACE_MAGIC_SIZE) / sizeof(trace_rec_t);
+
+	// The table never holds more than one entry per record, and gets twice
+	// as many entries.
+	trace_table_t table;
+	size_t size = 1;
+	while (size < 2 * t->nrecs) {
+		size *= 2;
+	}
+	table.entries = trace_map(size * sizeof(trace_entry_t));
+	table.mask = size - 1;
+	t->ops = trace_map((t->nrecs + 1) * sizeof(trace_op_t));
+	if (table.entries == NULL || t->ops == NULL) {
+		fprintf(stderr, "out of memory for %s\n", path);
+		return -1;
+	}
+	trace_prepare((const trace_rec_t*)(file + TRACE_MAGIC_SIZE), t->nrecs, t, &table);
+	munmap(table.entries, size * sizeof(trace_entry_t));
+	munmap(file, st.st_size);
+	return 0;
+}
+
+#endif
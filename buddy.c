@@ -5,6 +5,15 @@
 #include <unistd.h>
 #include <errno.h>
 #include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/sysinfo.h>
+
+#include "lock.h"
+#include "probe.h"
+#include "smalloc.h"
+#include "tcache.h"
 
 /*
 The buddy system is an allocation system which continuously splits a large
@@ -57,6 +66,81 @@ A request for size 8 would result in this tree:
 
 The recipes for finding parents, children, the length of the array, size of a
 block on a certain level etc, requires a piece of paper and patience.
+
+To be usable from multiple threads, memory is split into arenas. Each arena is
+a buddy system of its own with a spacetree and a lock (see lock.h). Threads are hashed onto
+the first __NTHREAD_ARENAS(ncpu) arenas, so that threads mostly allocate without
+contending. When a thread's arena runs out of space, the thread takes the block
+from the first other arena in use that has room, and moves there. Only when
+none has room does it move on to an unused arena. This keeps a thread that
+allocated a lot and went idle from holding on to free space while another
+thread maps new arenas.
+
+Free blocks keep nothing in their memory, so their pages can be given back to
+the OS at any time. Whenever a thread's arena is exhausted, and at most every
+__RECLAIM_INTERVAL_NS, the arenas that nobody locked since the previous time
+have the pages of their free blocks of at least __PURGE_MIN bytes released with
+madvise(). Build with -DNO_ARENA_STEAL to do neither.
+
+The address space for all __MAX_ARENAS arenas, and separately for all their
+spacetrees, is reserved up front. Arena i starts at mem + i*__TOTAL_SIZE, so
+free() finds the owning arena of a pointer from its offset alone, whichever
+thread calls it. Pages are only backed by memory once they are touched.
+
+A thread that frees a block of another thread's arena doesn't take that arena's
+lock. It pushes the block onto the arena's remote list instead, a lock-free
+stack linked through the first word of each block, and the threads of the arena
+free the whole list at once on their next allocation. The first block of the
+list also holds the list's length: the thread that would make it longer than
+__REMOTE_MAX frees the list itself, so that an arena all of whose threads moved
+on doesn't hold on to its remote frees. Build with -DNO_REMOTE_FREE to always
+free into the arena under its lock.
+
+Next to its spacetree, an arena keeps the order (log2(size/__MIN_SIZE)) of
+every allocated block, indexed by the block's first __MIN_SIZE leaf. This gives
+the size of a block on free() without walking the tree.
+
+Built with -DBUDDY_LOCKFREE, the arenas have no locks and are shared by all
+threads. Spacetree nodes are then only changed with compare-and-swap:
+
+- malloc() descends as usual and claims the block by swapping the node from its
+  full size to its full size with the OCCUPIED bit set. Only a node that is
+  entirely free can be claimed.
+- The parents are then recomputed from their children, each with a CAS retry
+  loop. A parent is re-checked after it was written, in case a child changed
+  after it was read.
+- If a parent turns out to be OCCUPIED, another thread claimed a larger block
+  containing ours in the meantime. The claim is undone and malloc() retries.
+- free() stores the full size back into the node and recomputes the parents.
+
+A node is read as 0 while OCCUPIED, so OCCUPIED nodes look exactly like
+allocated nodes of the locked tree to everyone else.
+
+All allocator metadata, the spacetrees and order maps, lives in the mapping
+reserved for it, apart from the memory it describes. Pages of allocated blocks
+are only written to by their owners, and remote frees write the first word of a
+block. After fork(), a child that allocates and frees copies the pages of the
+spacetrees it changes, not the pages of the blocks, as long as its frees go
+neither to the thread cache nor to a remote list, which both link blocks
+through their first word. A child's frees of its parent's blocks are remote,
+so only a -DNO_TCACHE -DNO_REMOTE_FREE build gets the savings (see make
+bench-fork).
+
+Around fork(), arenas_lock and the lock of every arena in use are taken, so
+that the child starts with consistent arenas whatever the other threads of the
+parent were doing. A lock-free build can't stop the other threads, and a child
+that forks while they are in the middle of an operation may see a spacetree
+that is off by one block.
+
+smalloc_heap_map() writes out which min blocks of each arena are free, see
+smalloc.h. Blocks in a thread cache or on a remote list show as allocated.
+
+Blocks of up to __TCACHE_MAX_SIZE bytes are served from the thread cache in
+tcache.c, see tcache.h. Build with -DNO_TCACHE to go to the arenas directly,
+or with -DTCACHE_PERCPU to cache per CPU instead of per thread.
+
+Allocations, frees, copies, exhaustion and growth have static tracepoints, see
+probe.h.
 */
 
 #define DEBUG 0
@@ -64,15 +148,65 @@ block on a certain level etc, requires a piece of paper and patience.
 		do { if (DEBUG) fprintf(stderr, ##__VA_ARGS__); } while (0)
 
 #define MAX(x, y) (x > y ? x : y)
+#define MIN(x, y) (x < y ? x : y)
 
 #define __TOTAL_SIZE (1024*1024*2)
 #define __MIN_SIZE (32)
 #define __NBLOCKS (__TOTAL_SIZE/__MIN_SIZE)
 
+#define __NORDERS (__builtin_ctz(__NBLOCKS) + 1)
+// Min blocks per line of the heap map.
+#define __MAP_WIDTH (128)
+
 #define __SPACETREE_SIZE ((__NBLOCKS)*2*sizeof(uint32_t))
+#define __META_SIZE (__SPACETREE_SIZE + __NBLOCKS)
+
+#define OCCUPIED ((uint32_t)1 << 31)
+
+// Blocks up to this size go through the thread cache, one bin per order.
+#define __TCACHE_MAX_SIZE (1024)
+
+#define __REMOTE_MAX (1024)
+
+#define __PURGE_MIN (4096)
+#define __RECLAIM_INTERVAL_NS (10*1000*1000)
+
+#define __MAX_ARENAS (64)
+#ifndef __NTHREAD_ARENAS
+#define __NTHREAD_ARENAS(ncpu) (MIN(4*(ncpu), __MAX_ARENAS/2))
+#endif
+
+typedef struct arena_t {
+	lock_t lock;
+	uint32_t *spacetree;
+	uint8_t *orders;
+	uint8_t *mem;
+	void *remote;
+	// Lock acquires when the arena was last seen by arenas_reclaim(), and
+	// when its free pages were last released.
+	uint64_t seen_acquires;
+	uint64_t purged_acquires;
+	// Bytes in allocated blocks, read without the lock.
+	size_t allocated;
+} arena_t;
 
 static uint8_t *mem = NULL;
-static uint32_t *spacetree = NULL;
+static uint8_t *meta = NULL;
+
+static arena_t arenas[__MAX_ARENAS];
+static size_t nthread_arenas = 1;
+
+// Serializes initialization of mem and of each arena.
+static pthread_mutex_t arenas_lock = PTHREAD_MUTEX_INITIALIZER;
+#ifndef BUDDY_LOCKFREE
+// Threads that have picked an arena, to hash the next one onto.
+static size_t nthreads = 0;
+#endif
+
+// Calls to mmap and madvise, read without locks by smalloc_info().
+static size_t syscalls = 0;
+
+static __thread arena_t *thread_arena __attribute__((tls_model("initial-exec"))) = NULL;
 
 static size_t
 left_child(size_t idx)
@@ -114,7 +248,7 @@ pow2_ceil(size_t x)
 }
 
 static void
-__alloc_reset_tree()
+__alloc_reset_tree(uint32_t *spacetree)
 {
 	uint32_t size = __TOTAL_SIZE*2;
 	for (uint32_t i = 0; i < 2 * __NBLOCKS - 1; i++) {
@@ -125,39 +259,305 @@ __alloc_reset_tree()
 	}
 }
 
-static void
+// Reserves the address space of all arenas. Must hold arenas_lock.
+static int
 __alloc_init()
 {
 	if (mem != NULL) {
-		return;
+		return 0;
 	}
-	mem = sbrk(__TOTAL_SIZE);
-	if (mem == (void*)-1)  {
-		errno = ENOMEM;
-		return;
+	int prot = PROT_READ | PROT_WRITE;
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+	void *m = mmap(NULL, (size_t)__MAX_ARENAS * __TOTAL_SIZE, prot, flags, -1, 0);
+	__atomic_fetch_add(&syscalls, 1, __ATOMIC_RELAXED);
+	if (m == MAP_FAILED) {
+		return -1;
+	}
+	void *t = mmap(NULL, (size_t)__MAX_ARENAS * __META_SIZE, prot, flags, -1, 0);
+	__atomic_fetch_add(&syscalls, 1, __ATOMIC_RELAXED);
+	if (t == MAP_FAILED) {
+		munmap(m, (size_t)__MAX_ARENAS * __TOTAL_SIZE);
+		return -1;
 	}
-	spacetree = sbrk(__SPACETREE_SIZE);
-	debug_print("init data_addr: %p space_addr: %p\n", (void*)mem, (void*)spacetree);
-	__alloc_reset_tree();
+	meta = t;
+	nthread_arenas = __NTHREAD_ARENAS(get_nprocs());
+	__atomic_store_n(&mem, m, __ATOMIC_RELEASE);
+	debug_print("init data_addr: %p space_addr: %p\n", (void*)mem, (void*)meta);
+	return 0;
 }
 
-
-void*
-malloc(size_t size)
+// Returns arena i, setting it up on first use. With i == -1, returns the first
+// arena that was never used, or NULL if there is none.
+static arena_t*
+arena_get(ssize_t i)
 {
-	if (mem == NULL) {
-		__alloc_init();
+	if (i >= 0 && __atomic_load_n(&arenas[i].mem, __ATOMIC_ACQUIRE) != NULL) {
+		return &arenas[i];
 	}
+	pthread_mutex_lock(&arenas_lock);
+	arena_t *a = NULL;
+	if (__alloc_init() != 0) {
+		goto out;
+	}
+	if (i == -1) {
+		i = 0;
+		while (i < __MAX_ARENAS && arenas[i].mem != NULL) {
+			i++;
+		}
+		if (i == __MAX_ARENAS) {
+			goto out;
+		}
+	}
+	a = &arenas[i];
+	if (a->mem == NULL) {
+		lock_init(&a->lock);
+		a->spacetree = (uint32_t*)(meta + (size_t)i * __META_SIZE);
+		a->orders = meta + (size_t)i * __META_SIZE + __SPACETREE_SIZE;
+		__alloc_reset_tree(a->spacetree);
+		__atomic_store_n(&a->mem, mem + (size_t)i * __TOTAL_SIZE, __ATOMIC_RELEASE);
+		PROBE2(grow, a->mem, __TOTAL_SIZE);
+		debug_print("arena %ld data_addr: %p\n", i, (void*)a->mem);
+	}
+out:
+	pthread_mutex_unlock(&arenas_lock);
+	return a;
+}
 
-	if (size == 0) {
+// Returns the arena owning ptr, or NULL if ptr is not from any arena.
+static arena_t*
+arena_of(void *ptr)
+{
+	uint8_t *m = __atomic_load_n(&mem, __ATOMIC_ACQUIRE);
+	if (m == NULL || (uint8_t*)ptr < m || (uint8_t*)ptr >= m + (size_t)__MAX_ARENAS * __TOTAL_SIZE) {
 		return NULL;
 	}
+	return &arenas[((uint8_t*)ptr - m) / __TOTAL_SIZE];
+}
 
-	size = MAX(pow2_ceil(size), __MIN_SIZE);
+static arena_t*
+thread_arena_get()
+{
+#ifdef BUDDY_LOCKFREE
+	if (thread_arena == NULL) {
+		thread_arena = arena_get(0);
+	}
+#else
+	if (thread_arena == NULL) {
+		size_t n = __atomic_fetch_add(&nthreads, 1, __ATOMIC_RELAXED);
+		// nthread_arenas is only known once mem is reserved.
+		thread_arena = arena_get(n == 0 ? 0 : n % __atomic_load_n(&nthread_arenas, __ATOMIC_RELAXED));
+	}
+#endif
+	return thread_arena;
+}
 
+static void
+arena_lock(arena_t *a)
+{
+#ifndef BUDDY_LOCKFREE
+	lock_acquire(&a->lock);
+#else
+	(void)a;
+#endif
+}
+
+static void
+arena_unlock(arena_t *a)
+{
+#ifndef BUDDY_LOCKFREE
+	lock_release(&a->lock);
+#else
+	(void)a;
+#endif
+}
+
+// Adds bytes to the allocated bytes of arena a. Must hold the arena lock,
+// unless the arenas are lock-free.
+static void
+arena_count(arena_t *a, ssize_t bytes)
+{
+#ifdef BUDDY_LOCKFREE
+	__atomic_fetch_add(&a->allocated, bytes, __ATOMIC_RELAXED);
+#else
+	__atomic_store_n(&a->allocated, a->allocated + bytes, __ATOMIC_RELAXED);
+#endif
+}
+
+// Returns the size of the block at ptr in arena a and sets *block_idx to its
+// node, or returns 0 if ptr does not point to an allocated block. Must hold the
+// arena lock.
+static size_t
+arena_block_size(arena_t *a, void *ptr, ssize_t *block_idx)
+{
+	size_t offset_bytes = (size_t)((uint8_t *)(ptr) - a->mem);
+	size_t size = (size_t)(__MIN_SIZE) << a->orders[offset_bytes / __MIN_SIZE];
+	if (offset_bytes % size != 0) {
+		return 0;
+	}
+	ssize_t idx = offset_bytes / size + __TOTAL_SIZE / size - 1;
+#ifdef BUDDY_LOCKFREE
+	if (__atomic_load_n(&a->spacetree[idx], __ATOMIC_ACQUIRE) != (size | OCCUPIED)) {
+		return 0;
+	}
+#else
+	if (a->spacetree[idx] != 0) {
+		return 0;
+	}
+#endif
+	*block_idx = idx;
+	return size;
+}
+
+#ifdef BUDDY_LOCKFREE
+// Returns the size of the node at idx when it is entirely free.
+static size_t
+node_size(size_t idx)
+{
+	return __TOTAL_SIZE >> (63 - __builtin_clzll(idx + 1));
+}
+
+static uint32_t
+node_avail(uint32_t *spacetree, size_t idx)
+{
+	uint32_t v = __atomic_load_n(&spacetree[idx], __ATOMIC_ACQUIRE);
+	return (v & OCCUPIED) ? 0 : v;
+}
+
+static uint32_t
+node_combine(uint32_t *spacetree, size_t idx)
+{
+	uint32_t l = node_avail(spacetree, left_child(idx));
+	uint32_t r = node_avail(spacetree, right_child(idx));
+	if (l + r == node_size(idx)) {
+		return l + r;
+	}
+	return MAX(l, r);
+}
+
+// Recomputes the node at idx from its children. Returns 0 if the node is
+// OCCUPIED, in which case its value does not depend on its children.
+static int
+node_update(uint32_t *spacetree, size_t idx)
+{
+	for (;;) {
+		uint32_t old = __atomic_load_n(&spacetree[idx], __ATOMIC_ACQUIRE);
+		if (old & OCCUPIED) {
+			return 0;
+		}
+		uint32_t new = node_combine(spacetree, idx);
+		if (old != new && !__atomic_compare_exchange_n(&spacetree[idx], &old, new, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			continue;
+		}
+		// A child may have changed after it was read, and its writer may
+		// have updated this node before we overwrote it.
+		if (node_combine(spacetree, idx) == new) {
+			return 1;
+		}
+	}
+}
+
+// Recomputes the parents of idx up to the root. Returns 0 when an OCCUPIED
+// parent stops the update.
+static int
+node_propagate(uint32_t *spacetree, size_t idx)
+{
+	while (idx > 0) {
+		idx = parent(idx);
+		if (!node_update(spacetree, idx)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static void*
+arena_malloc(arena_t *a, size_t size)
+{
+	uint32_t *spacetree = a->spacetree;
+	for (;;) {
+		if (node_avail(spacetree, 0) < size) {
+			return NULL;
+		}
+
+		// Find leftmost block that accomodates the request. The tree may
+		// change while we walk it, in which case we start over.
+		ssize_t idx = 0;
+		size_t block_size = __TOTAL_SIZE;
+		while (idx >= 0 && block_size != size) {
+			if (node_avail(spacetree, left_child(idx)) >= size) {
+				idx = left_child(idx);
+			} else if (node_avail(spacetree, right_child(idx)) >= size) {
+				idx = right_child(idx);
+			} else {
+				idx = -1;
+			}
+			block_size /= 2;
+		}
+		if (idx < 0) {
+			continue;
+		}
+
+		uint32_t expected = size;
+		if (!__atomic_compare_exchange_n(&spacetree[idx], &expected, size | OCCUPIED, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			continue;
+		}
+		if (!node_propagate(spacetree, idx)) {
+			// A block containing ours was claimed meanwhile.
+			__atomic_store_n(&spacetree[idx], size, __ATOMIC_RELEASE);
+			node_propagate(spacetree, idx);
+			continue;
+		}
+
+		size_t offset_bytes = block_size * (idx + 1) - __TOTAL_SIZE;
+		a->orders[offset_bytes / __MIN_SIZE] = __builtin_ctzll(size / __MIN_SIZE);
+		arena_count(a, size);
+		void *addr = (void *) ((char *)(a->mem) + offset_bytes);
+		debug_print("malloc ptr:%p, size:%ld idx:%ld\n", addr, size, idx);
+		return addr;
+	}
+}
+
+static void
+arena_free(arena_t *a, ssize_t idx, size_t size)
+{
+	arena_count(a, -(ssize_t)size);
+	__atomic_store_n(&a->spacetree[idx], size, __ATOMIC_RELEASE);
+	node_propagate(a->spacetree, idx);
+}
+
+// Allocates up to n blocks of size bytes from arena a into ptrs, and returns
+// how many. Every block is claimed on its own, see arena_malloc().
+static size_t
+arena_malloc_batch(arena_t *a, size_t size, size_t n, void **ptrs)
+{
+	size_t i = 0;
+	while (i < n && (ptrs[i] = arena_malloc(a, size)) != NULL) {
+		i++;
+	}
+	return i;
+}
+
+// Frees the n blocks in ptrs, sorted by address, into arena a.
+static void
+arena_free_sorted(arena_t *a, void **ptrs, size_t n)
+{
+	for (size_t i = 0; i < n; i++) {
+		ssize_t idx;
+		size_t size = arena_block_size(a, ptrs[i], &idx);
+		if (size != 0) {
+			arena_free(a, idx, size);
+		}
+	}
+}
+#else
+// Allocates a block of size bytes, a power of two, from arena a. Must hold the
+// arena lock.
+static void*
+arena_malloc(arena_t *a, size_t size)
+{
+	uint32_t *spacetree = a->spacetree;
 	if (size > spacetree[0]) {
 		debug_print("size %ld larger than space in tree %d\n", size, spacetree[0]);
-		errno = ENOMEM;
 		return NULL;
 	}
 
@@ -173,9 +573,11 @@ malloc(size_t size)
 	}
 
 	spacetree[idx] = 0;
+	arena_count(a, size);
 
 	size_t offset_bytes = block_size * (idx + 1) - __TOTAL_SIZE;
-	void *addr = (void *) ((char *)(mem) + offset_bytes);
+	a->orders[offset_bytes / __MIN_SIZE] = __builtin_ctzll(size / __MIN_SIZE);
+	void *addr = (void *) ((char *)(a->mem) + offset_bytes);
 
 	// Update tree
 	for (ssize_t i = idx; i > 0;) {
@@ -187,22 +589,13 @@ malloc(size_t size)
 	return addr;
 }
 
-void
-free(void *ptr)
+// Frees the block at tree index idx of arena a. Must hold the arena lock.
+static void
+arena_free(arena_t *a, ssize_t idx, size_t size)
 {
-	if (ptr == NULL) {
-		return;
-	}
-
-	ssize_t offset_bytes = (ssize_t)((char *)(ptr) - (char *)(mem));
-	ssize_t idx = offset_bytes / (__MIN_SIZE);
-	idx += (__NBLOCKS - 1);
-	size_t size = __MIN_SIZE;
-	while (idx > 0 && spacetree[idx] != 0) {
-		idx = parent(idx);
-		size *= 2;
-	}
+	uint32_t *spacetree = a->spacetree;
 	spacetree[idx] = size;
+	arena_count(a, -(ssize_t)size);
 	size_t l, r;
 	while (idx > 0) {
 		size *= 2;
@@ -216,7 +609,417 @@ free(void *ptr)
 			spacetree[idx] = MAX(l, r);
 		}
 	}
-	debug_print("free ptr:%p largest_block:%d\n", ptr, spacetree[0]);
+}
+
+// Claims up to n blocks of size bytes below node idx, leftmost first, into
+// ptrs. Every node on the way is recomputed once, after its children.
+static size_t
+arena_claim(arena_t *a, size_t idx, size_t block_size, size_t size, size_t n, void **ptrs)
+{
+	uint32_t *spacetree = a->spacetree;
+	if (n == 0 || spacetree[idx] < size) {
+		return 0;
+	}
+	if (block_size == size) {
+		spacetree[idx] = 0;
+		arena_count(a, size);
+		size_t offset_bytes = block_size * (idx + 1) - __TOTAL_SIZE;
+		a->orders[offset_bytes / __MIN_SIZE] = __builtin_ctzll(size / __MIN_SIZE);
+		ptrs[0] = a->mem + offset_bytes;
+		return 1;
+	}
+	size_t k = arena_claim(a, left_child(idx), block_size / 2, size, n, ptrs);
+	k += arena_claim(a, right_child(idx), block_size / 2, size, n - k, ptrs + k);
+	spacetree[idx] = MAX(spacetree[left_child(idx)], spacetree[right_child(idx)]);
+	return k;
+}
+
+// Allocates up to n blocks of size bytes, a power of two, from arena a into
+// ptrs in a single pass over the tree, and returns how many. Must hold the
+// arena lock.
+static size_t
+arena_malloc_batch(arena_t *a, size_t size, size_t n, void **ptrs)
+{
+	return arena_claim(a, 0, __TOTAL_SIZE, size, n, ptrs);
+}
+
+// Frees the blocks at ptrs[0..n), sorted by address and all within the block
+// of node idx. Every node on the way is recomputed once, after its children,
+// so neighbours are merged in a single pass.
+static void
+arena_release(arena_t *a, size_t idx, size_t block_size, void **ptrs, size_t n)
+{
+	uint32_t *spacetree = a->spacetree;
+	size_t offset_bytes = block_size * (idx + 1) - __TOTAL_SIZE;
+	if (spacetree[idx] == 0 && ((size_t)(__MIN_SIZE) << a->orders[offset_bytes / __MIN_SIZE]) == block_size) {
+		// The block of this node is allocated. Any pointer into it other
+		// than to its start is not a block.
+		if ((uint8_t*)(ptrs[0]) == a->mem + offset_bytes) {
+			spacetree[idx] = block_size;
+			arena_count(a, -(ssize_t)block_size);
+		}
+		return;
+	}
+	if (block_size == __MIN_SIZE) {
+		return;
+	}
+	uint8_t *middle = a->mem + offset_bytes + block_size / 2;
+	size_t k = 0;
+	while (k < n && (uint8_t*)(ptrs[k]) < middle) {
+		k++;
+	}
+	if (k > 0) {
+		arena_release(a, left_child(idx), block_size / 2, ptrs, k);
+	}
+	if (k < n) {
+		arena_release(a, right_child(idx), block_size / 2, ptrs + k, n - k);
+	}
+	uint32_t l = spacetree[left_child(idx)];
+	uint32_t r = spacetree[right_child(idx)];
+	spacetree[idx] = l + r == block_size ? block_size : MAX(l, r);
+}
+
+// Frees the n blocks in ptrs, sorted by address, into arena a. Must hold the
+// arena lock.
+static void
+arena_free_sorted(arena_t *a, void **ptrs, size_t n)
+{
+	arena_release(a, 0, __TOTAL_SIZE, ptrs, n);
+}
+#endif
+
+#if defined(BUDDY_LOCKFREE) || defined(NO_REMOTE_FREE)
+static void
+arena_drain_remote(arena_t *a)
+{
+	(void)a;
+}
+#else
+// Frees the NULL-terminated list of blocks at head into arena a. Must hold the
+// arena lock.
+static void
+arena_free_list(arena_t *a, void *head)
+{
+	while (head != NULL) {
+		void *next = *(void**)(head);
+		ssize_t idx;
+		size_t size = arena_block_size(a, head, &idx);
+		if (size != 0) {
+			arena_free(a, idx, size);
+		}
+		head = next;
+	}
+}
+
+// Frees the blocks other threads pushed onto the remote list of arena a. Must
+// hold the arena lock.
+static void
+arena_drain_remote(arena_t *a)
+{
+	if (__atomic_load_n(&a->remote, __ATOMIC_RELAXED) == NULL) {
+		return;
+	}
+	arena_free_list(a, __atomic_exchange_n(&a->remote, NULL, __ATOMIC_ACQUIRE));
+}
+
+// Pushes the count blocks linked from first to last onto the remote list of
+// arena a.
+static void
+arena_push_remote(arena_t *a, void *first, void *last, size_t count)
+{
+	void *head = __atomic_load_n(&a->remote, __ATOMIC_ACQUIRE);
+	for (;;) {
+		// The length may be read from a head that was just drained, the CAS
+		// then fails.
+		size_t total = count + (head != NULL ? ((size_t*)(head))[1] : 0);
+		if (total > __REMOTE_MAX) {
+			*(void**)(last) = NULL;
+			arena_lock(a);
+			arena_drain_remote(a);
+			arena_free_list(a, first);
+			arena_unlock(a);
+			return;
+		}
+		*(void**)(last) = head;
+		((size_t*)(first))[1] = total;
+		if (__atomic_compare_exchange_n(&a->remote, &head, first, 1, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+			return;
+		}
+	}
+}
+#endif
+
+// Frees the n blocks in ptrs, which all belong to arena a.
+static void
+arena_free_batch(arena_t *a, void **ptrs, size_t n)
+{
+#if !defined(BUDDY_LOCKFREE) && !defined(NO_REMOTE_FREE)
+	if (a != thread_arena) {
+		for (size_t i = 0; i + 1 < n; i++) {
+			*(void**)(ptrs[i]) = ptrs[i + 1];
+		}
+		arena_push_remote(a, ptrs[0], ptrs[n - 1], n);
+		return;
+	}
+#endif
+	size_t sorted = 1;
+	while (sorted < n && (uintptr_t)(ptrs[sorted - 1]) < (uintptr_t)(ptrs[sorted])) {
+		sorted++;
+	}
+	arena_lock(a);
+	if (sorted == n) {
+		arena_free_sorted(a, ptrs, n);
+	} else {
+		for (size_t i = 0; i < n; i++) {
+			ssize_t idx;
+			size_t size = arena_block_size(a, ptrs[i], &idx);
+			if (size != 0) {
+				arena_free(a, idx, size);
+			}
+		}
+	}
+	arena_unlock(a);
+}
+
+#if !defined(BUDDY_LOCKFREE) && !defined(NO_ARENA_STEAL)
+// Releases the pages of the free blocks under node idx, a block of block_size
+// bytes. Must hold the arena lock.
+static void
+arena_purge(arena_t *a, size_t idx, size_t block_size)
+{
+	size_t avail = a->spacetree[idx];
+	if (avail < __PURGE_MIN) {
+		return;
+	}
+	if (avail == block_size) {
+		size_t offset_bytes = block_size * (idx + 1) - __TOTAL_SIZE;
+		madvise(a->mem + offset_bytes, block_size, MADV_DONTNEED);
+		__atomic_fetch_add(&syscalls, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	arena_purge(a, left_child(idx), block_size / 2);
+	arena_purge(a, right_child(idx), block_size / 2);
+}
+
+// Releases the free pages of the arenas that were not locked since the
+// previous call, if that was at least __RECLAIM_INTERVAL_NS ago. Remote frees
+// don't lock the arena, so they are drained first.
+static void
+arenas_reclaim(void)
+{
+	static uint64_t last_ns = 0;
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	uint64_t now_ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	if (now_ns - __atomic_load_n(&last_ns, __ATOMIC_RELAXED) < __RECLAIM_INTERVAL_NS) {
+		return;
+	}
+	if (pthread_mutex_trylock(&arenas_lock) != 0) {
+		return;
+	}
+	__atomic_store_n(&last_ns, now_ns, __ATOMIC_RELAXED);
+	for (size_t i = 0; i < __MAX_ARENAS; i++) {
+		arena_t *a = &arenas[i];
+		if (a->mem == NULL) {
+			continue;
+		}
+		uint64_t acquires = __atomic_load_n(&a->lock.acquires, __ATOMIC_RELAXED);
+		int idle = acquires == a->seen_acquires;
+		a->seen_acquires = acquires;
+		if (!idle || acquires == a->purged_acquires) {
+			continue;
+		}
+		arena_lock(a);
+		arena_drain_remote(a);
+		arena_purge(a, 0, __TOTAL_SIZE);
+		a->purged_acquires = a->lock.acquires;
+		a->seen_acquires = a->lock.acquires;
+		arena_unlock(a);
+	}
+	pthread_mutex_unlock(&arenas_lock);
+}
+
+// Allocates a block of size bytes from any arena in use other than a, and moves
+// the calling thread there.
+static void*
+arena_steal(arena_t *a, size_t size)
+{
+	for (size_t i = 0; i < __MAX_ARENAS; i++) {
+		arena_t *victim = &arenas[i];
+		if (victim == a || __atomic_load_n(&victim->mem, __ATOMIC_ACQUIRE) == NULL) {
+			continue;
+		}
+		// Blocks on the remote list may make room once freed.
+		if (__atomic_load_n(&victim->spacetree[0], __ATOMIC_RELAXED) < size &&
+				__atomic_load_n(&victim->remote, __ATOMIC_RELAXED) == NULL) {
+			continue;
+		}
+		arena_lock(victim);
+		arena_drain_remote(victim);
+		void *addr = arena_malloc(victim, size);
+		arena_unlock(victim);
+		if (addr != NULL) {
+			thread_arena = victim;
+			return addr;
+		}
+	}
+	return NULL;
+}
+#endif
+
+// Allocates a block of size bytes, a power of two, from the calling thread's
+// arena, moving the thread to another arena when its own is exhausted.
+static void*
+buddy_malloc(size_t size)
+{
+	arena_t *a = thread_arena_get();
+	if (a == NULL) {
+		return NULL;
+	}
+	arena_lock(a);
+	arena_drain_remote(a);
+	void *addr = arena_malloc(a, size);
+	arena_unlock(a);
+	if (addr != NULL) {
+		return addr;
+	}
+	PROBE2(exhausted, size, a - arenas);
+
+#ifdef BUDDY_LOCKFREE
+	// The arenas are shared by all threads, so take the first one with room
+	// and stay there.
+	for (ssize_t i = 0; i < __MAX_ARENAS; i++) {
+		a = arena_get(i);
+		if (a == NULL) {
+			break;
+		}
+		addr = arena_malloc(a, size);
+		if (addr != NULL) {
+			thread_arena = a;
+			return addr;
+		}
+	}
+	return NULL;
+#else
+#ifndef NO_ARENA_STEAL
+	arenas_reclaim();
+	addr = arena_steal(a, size);
+	if (addr != NULL) {
+		return addr;
+	}
+#endif
+
+	// No arena in use has room, move the thread to a fresh one.
+	a = arena_get(-1);
+	if (a == NULL) {
+#ifndef NO_ARENA_STEAL
+		// All arenas are in use. Other threads may have freed enough since
+		// we looked.
+		return arena_steal(NULL, size);
+#else
+		return NULL;
+#endif
+	}
+	thread_arena = a;
+	arena_lock(a);
+	addr = arena_malloc(a, size);
+	arena_unlock(a);
+	return addr;
+#endif
+}
+
+size_t
+backend_malloc_batch(size_t size, size_t n, void **ptrs)
+{
+	size = MAX(pow2_ceil(size), __MIN_SIZE);
+	size_t i = 0;
+	arena_t *a = thread_arena_get();
+	if (a != NULL) {
+		arena_lock(a);
+		arena_drain_remote(a);
+		i = arena_malloc_batch(a, size, n, ptrs);
+		arena_unlock(a);
+	}
+	if (i == 0) {
+		ptrs[0] = buddy_malloc(size);
+		i = ptrs[0] != NULL;
+	}
+	return i;
+}
+
+void
+backend_free_batch(void **ptrs, size_t n)
+{
+	// Consecutive blocks of the same arena are freed at once.
+	size_t i = 0;
+	while (i < n) {
+		arena_t *a = arena_of(ptrs[i]);
+		size_t j = i + 1;
+		while (j < n && arena_of(ptrs[j]) == a) {
+			j++;
+		}
+		if (a != NULL) {
+			arena_free_batch(a, &ptrs[i], j - i);
+		}
+		i = j;
+	}
+}
+
+void*
+malloc(size_t size)
+{
+	if (size == 0) {
+		return NULL;
+	}
+	if (size > __TOTAL_SIZE) {
+		errno = ENOMEM;
+		PROBE2(malloc, NULL, size);
+		return NULL;
+	}
+
+	size_t request = size;
+	size = MAX(pow2_ceil(size), __MIN_SIZE);
+
+	void *addr;
+#ifndef NO_TCACHE
+	if (size <= __TCACHE_MAX_SIZE) {
+		addr = tcache_malloc(__builtin_ctzll(size / __MIN_SIZE), size);
+	} else {
+		addr = buddy_malloc(size);
+	}
+#else
+	addr = buddy_malloc(size);
+#endif
+	if (addr == NULL) {
+		errno = ENOMEM;
+	}
+	PROBE2(malloc, addr, request);
+	return addr;
+}
+
+void
+free(void *ptr)
+{
+	if (ptr == NULL) {
+		return;
+	}
+	PROBE1(free, ptr);
+
+	arena_t *a = arena_of(ptr);
+	if (a == NULL) {
+		return;
+	}
+#ifndef NO_TCACHE
+	// The order of a block is only written when it is allocated, so the
+	// owner of the block can read it without the lock.
+	size_t order = a->orders[((uint8_t*)(ptr) - a->mem) / __MIN_SIZE];
+	if (((size_t)(__MIN_SIZE) << order) <= __TCACHE_MAX_SIZE) {
+		tcache_free(order, ptr);
+		return;
+	}
+#endif
+	backend_free_batch(&ptr, 1);
+	debug_print("free ptr:%p\n", ptr);
 }
 
 void
@@ -232,15 +1035,16 @@ void
 	}
 
 	// Determine old size
-	ssize_t offset_bytes = (size_t)((char *)ptr - (char *)mem);
-	ssize_t idx = offset_bytes / (__MIN_SIZE);
-	idx += (__NBLOCKS - 1);
-	size_t old_size = __MIN_SIZE;
-	while (idx > 0 && spacetree[idx] != 0) {
-		idx = parent(idx);
-		old_size *= 2;
+	arena_t *a = arena_of(ptr);
+	if (a == NULL) {
+		debug_print("could not find arena of ptr %p\n", ptr);
+		return NULL;
 	}
-	if (spacetree[idx] != 0) {
+	ssize_t idx;
+	arena_lock(a);
+	size_t old_size = arena_block_size(a, ptr, &idx);
+	arena_unlock(a);
+	if (old_size == 0) {
 		// Could not find block pointed to by ptr
 		debug_print("could not find block pointed to by ptr %p\n", ptr);
 		return NULL;
@@ -259,6 +1063,7 @@ void
 		return ptr;
 	}
 
+	PROBE3(realloc_copy, ptr, new_ptr, old_size);
 	memcpy(new_ptr, ptr, old_size);
 	free(ptr);
 	return new_ptr;
@@ -276,3 +1081,279 @@ void
 	memset(ptr, 0, rqsize);
 	return ptr;
 }
+
+size_t
+smalloc_batch(size_t size, size_t n, void **ptrs)
+{
+	if (size == 0) {
+		return 0;
+	}
+	if (size > __TOTAL_SIZE) {
+		errno = ENOMEM;
+		return 0;
+	}
+#ifndef NO_TCACHE
+	// Short batches are served best by the thread cache.
+	if (n <= TCACHE_MAX_COUNT) {
+		size_t i = 0;
+		while (i < n && (ptrs[i] = malloc(size)) != NULL) {
+			i++;
+		}
+		return i;
+	}
+#endif
+	// Longer ones are taken straight from the arenas, as many as possible
+	// in each pass over a tree.
+	size = MAX(pow2_ceil(size), __MIN_SIZE);
+	size_t i = 0;
+	while (i < n) {
+		size_t k = backend_malloc_batch(size, n - i, &ptrs[i]);
+		if (k == 0) {
+			errno = ENOMEM;
+			break;
+		}
+		i += k;
+	}
+	return i;
+}
+
+static int
+ptr_cmp(const void *a, const void *b)
+{
+	uintptr_t x = (uintptr_t)(*(void *const *)a);
+	uintptr_t y = (uintptr_t)(*(void *const *)b);
+	return (x > y) - (x < y);
+}
+
+// Sorts ptrs by address, unless they already are.
+static void
+sort_ptrs(void **ptrs, size_t n)
+{
+	for (size_t i = 1; i < n; i++) {
+		if ((uintptr_t)(ptrs[i - 1]) > (uintptr_t)(ptrs[i])) {
+			qsort(ptrs, n, sizeof(void*), ptr_cmp);
+			return;
+		}
+	}
+}
+
+void
+sfree_batch(void **ptrs, size_t n)
+{
+	// Sorted, the blocks of each arena are consecutive and are freed in a
+	// single pass over its tree. NULLs end up first.
+#ifndef NO_TCACHE
+	if (n <= TCACHE_MAX_COUNT) {
+		for (size_t i = 0; i < n; i++) {
+			free(ptrs[i]);
+		}
+		return;
+	}
+#endif
+	sort_ptrs(ptrs, n);
+	size_t i = 0;
+	while (i < n && ptrs[i] == NULL) {
+		i++;
+	}
+	backend_free_batch(&ptrs[i], n - i);
+}
+
+size_t
+smalloc_lock_stats(smalloc_lock_stats_t *stats, size_t n)
+{
+#ifdef BUDDY_LOCKFREE
+	(void)stats;
+	(void)n;
+	return 0;
+#else
+	size_t narenas = 0;
+	for (size_t i = 0; i < __MAX_ARENAS; i++) {
+		int used = __atomic_load_n(&arenas[i].mem, __ATOMIC_ACQUIRE) != NULL;
+		if (used) {
+			narenas = i + 1;
+		}
+		if (i >= n) {
+			continue;
+		}
+		if (used) {
+			lock_stats(&arenas[i].lock, &stats[i]);
+		} else {
+			memset(&stats[i], 0, sizeof(stats[i]));
+		}
+	}
+	return narenas;
+#endif
+}
+
+void
+smalloc_heap_stats(smalloc_heap_stats_t *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	for (size_t i = 0; i < __MAX_ARENAS; i++) {
+		if (__atomic_load_n(&arenas[i].mem, __ATOMIC_ACQUIRE) == NULL) {
+			continue;
+		}
+		stats->footprint += __TOTAL_SIZE;
+		stats->allocated += __atomic_load_n(&arenas[i].allocated, __ATOMIC_RELAXED);
+	}
+}
+
+// Adds the free blocks under node idx, a block of block_size bytes, to info.
+// Must hold the arena lock.
+static void
+arena_info(arena_t *a, size_t idx, size_t block_size, smalloc_info_t *info)
+{
+#ifdef BUDDY_LOCKFREE
+	size_t avail = node_avail(a->spacetree, idx);
+#else
+	size_t avail = a->spacetree[idx];
+#endif
+	if (avail == 0) {
+		return;
+	}
+	if (avail == block_size) {
+		smalloc_class_info_t *c = &info->classes[__builtin_ctzll(block_size / __MIN_SIZE)];
+		c->blocks++;
+		c->bytes += block_size;
+		info->free += block_size;
+		info->free_blocks++;
+		// The largest of these in an arena is what its root holds.
+		info->largest_free = MAX(info->largest_free, block_size);
+		return;
+	}
+	arena_info(a, left_child(idx), block_size / 2, info);
+	arena_info(a, right_child(idx), block_size / 2, info);
+}
+
+void
+smalloc_info(smalloc_info_t *info)
+{
+	memset(info, 0, sizeof(*info));
+	// One class per order.
+	info->nclasses = __NORDERS;
+	for (size_t i = 0; i < info->nclasses; i++) {
+		info->classes[i].size = (uint64_t)__MIN_SIZE << i;
+	}
+	for (size_t i = 0; i < __MAX_ARENAS; i++) {
+		arena_t *a = &arenas[i];
+		if (__atomic_load_n(&a->mem, __ATOMIC_ACQUIRE) == NULL) {
+			continue;
+		}
+		// Blocks on the remote list count as allocated until drained.
+		arena_lock(a);
+		info->footprint += __TOTAL_SIZE;
+		info->allocated += __atomic_load_n(&a->allocated, __ATOMIC_RELAXED);
+		info->metadata += __META_SIZE;
+		arena_info(a, 0, __TOTAL_SIZE, info);
+		arena_unlock(a);
+	}
+	info->syscalls = __atomic_load_n(&syscalls, __ATOMIC_RELAXED);
+}
+
+// Marks the min blocks under node idx, a block of block_size bytes, in map, one
+// char each, and counts the free blocks of each order in counts. Must hold
+// the arena lock.
+static void
+arena_map(arena_t *a, size_t idx, size_t block_size, char *map, uint64_t *counts)
+{
+	size_t offset_bytes = block_size * (idx + 1) - __TOTAL_SIZE;
+	char *m = map + offset_bytes / __MIN_SIZE;
+	size_t order = __builtin_ctzll(block_size / __MIN_SIZE);
+#ifdef BUDDY_LOCKFREE
+	size_t avail = node_avail(a->spacetree, idx);
+#else
+	size_t avail = a->spacetree[idx];
+#endif
+	if (avail == block_size) {
+		memset(m, '.', block_size / __MIN_SIZE);
+		m[0] = '|';
+		counts[order]++;
+		return;
+	}
+	// Below an allocated node, the tree is left as it was. The order of the
+	// block at an offset is written on every allocation, so only an
+	// allocated node has its own order there.
+	if (block_size == __MIN_SIZE || (avail == 0 && a->orders[offset_bytes / __MIN_SIZE] == order)) {
+		memset(m, '#', block_size / __MIN_SIZE);
+		return;
+	}
+	arena_map(a, left_child(idx), block_size / 2, map, counts);
+	arena_map(a, right_child(idx), block_size / 2, map, counts);
+}
+
+static int
+write_all(int fd, const char *buf, size_t n)
+{
+	while (n > 0) {
+		ssize_t k = write(fd, buf, n);
+		if (k <= 0) {
+			return -1;
+		}
+		buf += k;
+		n -= k;
+	}
+	return 0;
+}
+
+int
+smalloc_heap_map(int fd)
+{
+	// One map at a time, built without allocating since an arena lock is
+	// held meanwhile.
+	static char map[__NBLOCKS];
+	char line[128];
+	int err = 0;
+	pthread_mutex_lock(&arenas_lock);
+	int n = snprintf(line, sizeof(line), "heapmap %d %d\n", __MIN_SIZE, __TOTAL_SIZE);
+	err |= write_all(fd, line, n);
+	for (size_t i = 0; i < __MAX_ARENAS && err == 0; i++) {
+		arena_t *a = &arenas[i];
+		if (a->mem == NULL) {
+			continue;
+		}
+		uint64_t counts[__NORDERS] = {0};
+		arena_lock(a);
+		arena_map(a, 0, __TOTAL_SIZE, map, counts);
+		arena_unlock(a);
+		n = snprintf(line, sizeof(line), "arena %zu\n", i);
+		err |= write_all(fd, line, n);
+		for (size_t k = 0; k < __NORDERS; k++) {
+			n = snprintf(line, sizeof(line), "order %zu %lu\n", k, (unsigned long)counts[k]);
+			err |= write_all(fd, line, n);
+		}
+		for (size_t j = 0; j < __NBLOCKS && err == 0; j += __MAP_WIDTH) {
+			err |= write_all(fd, map + j, __MAP_WIDTH);
+			err |= write_all(fd, "\n", 1);
+		}
+	}
+	pthread_mutex_unlock(&arenas_lock);
+	return err == 0 ? 0 : -1;
+}
+
+static void
+fork_prepare(void)
+{
+	pthread_mutex_lock(&arenas_lock);
+	for (size_t i = 0; i < __MAX_ARENAS; i++) {
+		if (arenas[i].mem != NULL) {
+			arena_lock(&arenas[i]);
+		}
+	}
+}
+
+static void
+fork_release(void)
+{
+	for (size_t i = 0; i < __MAX_ARENAS; i++) {
+		if (arenas[i].mem != NULL) {
+			arena_unlock(&arenas[i]);
+		}
+	}
+	pthread_mutex_unlock(&arenas_lock);
+}
+
+__attribute__((constructor)) static void
+fork_handlers_init(void)
+{
+	pthread_atfork(fork_prepare, fork_release, fork_release);
+}
@@ -0,0 +1,99 @@
+#include <errno.h>
+#include <malloc.h>
+#include <stdio.h>
+
+#include "smalloc.h"
+
+struct mallinfo2
+mallinfo2(void)
+{
+	smalloc_info_t info;
+	smalloc_info(&info);
+	struct mallinfo2 mi = {0};
+	mi.arena = info.footprint;
+	mi.ordblks = info.free_blocks;
+	mi.uordblks = info.allocated;
+	mi.fordblks = info.free;
+	mi.keepcost = info.top;
+	return mi;
+}
+
+void
+malloc_stats(void)
+{
+	smalloc_info_t info;
+	smalloc_info(&info);
+	fprintf(stderr, "system bytes     = %10lu\n", (unsigned long)info.footprint);
+	fprintf(stderr, "in use bytes     = %10lu\n", (unsigned long)info.allocated);
+	fprintf(stderr, "free bytes       = %10lu\n", (unsigned long)info.free);
+	fprintf(stderr, "free blocks      = %10lu\n", (unsigned long)info.free_blocks);
+	fprintf(stderr, "largest free     = %10lu\n", (unsigned long)info.largest_free);
+	fprintf(stderr, "top bytes        = %10lu\n", (unsigned long)info.top);
+	fprintf(stderr, "metadata bytes   = %10lu\n", (unsigned long)info.metadata);
+	fprintf(stderr, "syscalls         = %10lu\n", (unsigned long)info.syscalls);
+}
+
+static void
+info_xml(const smalloc_info_t *info, FILE *fp)
+{
+	fprintf(fp, "<malloc version=\"smalloc-1\">\n");
+	fprintf(fp, "<sizes>\n");
+	for (size_t i = 0; i < info->nclasses; i++) {
+		const smalloc_class_info_t *c = &info->classes[i];
+		if (c->blocks > 0) {
+			fprintf(fp, "<size from=\"%lu\" to=\"%lu\" total=\"%lu\" count=\"%lu\"/>\n",
+				(unsigned long)c->size, (unsigned long)(2 * c->size - 1),
+				(unsigned long)c->bytes, (unsigned long)c->blocks);
+		}
+	}
+	fprintf(fp, "</sizes>\n");
+	fprintf(fp, "<total type=\"free\" count=\"%lu\" size=\"%lu\"/>\n",
+		(unsigned long)info->free_blocks, (unsigned long)info->free);
+	fprintf(fp, "<total type=\"largest\" size=\"%lu\"/>\n", (unsigned long)info->largest_free);
+	fprintf(fp, "<total type=\"top\" size=\"%lu\"/>\n", (unsigned long)info->top);
+	fprintf(fp, "<total type=\"inuse\" size=\"%lu\"/>\n", (unsigned long)info->allocated);
+	fprintf(fp, "<total type=\"metadata\" size=\"%lu\"/>\n", (unsigned long)info->metadata);
+	fprintf(fp, "<system type=\"current\" size=\"%lu\"/>\n", (unsigned long)info->footprint);
+	fprintf(fp, "<syscalls count=\"%lu\"/>\n", (unsigned long)info->syscalls);
+	fprintf(fp, "</malloc>\n");
+}
+
+static void
+info_json(const smalloc_info_t *info, FILE *fp)
+{
+	fprintf(fp, "{\"footprint\":%lu,\"allocated\":%lu,\"free\":%lu,\"free_blocks\":%lu,"
+		"\"largest_free\":%lu,\"top\":%lu,\"metadata\":%lu,\"syscalls\":%lu,\"sizes\":[",
+		(unsigned long)info->footprint, (unsigned long)info->allocated,
+		(unsigned long)info->free, (unsigned long)info->free_blocks,
+		(unsigned long)info->largest_free, (unsigned long)info->top,
+		(unsigned long)info->metadata, (unsigned long)info->syscalls);
+	const char *sep = "";
+	for (size_t i = 0; i < info->nclasses; i++) {
+		const smalloc_class_info_t *c = &info->classes[i];
+		if (c->blocks > 0) {
+			fprintf(fp, "%s{\"from\":%lu,\"to\":%lu,\"total\":%lu,\"count\":%lu}", sep,
+				(unsigned long)c->size, (unsigned long)(2 * c->size - 1),
+				(unsigned long)c->bytes, (unsigned long)c->blocks);
+			sep = ",";
+		}
+	}
+	fprintf(fp, "]}\n");
+}
+
+int
+malloc_info(int options, FILE *fp)
+{
+	if (options != 0 && options != SMALLOC_INFO_JSON) {
+		errno = EINVAL;
+		return -1;
+	}
+	// Filled in before anything is written, since fp may allocate.
+	smalloc_info_t info;
+	smalloc_info(&info);
+	if (options == SMALLOC_INFO_JSON) {
+		info_json(&info, fp);
+	} else {
+		info_xml(&info, fp);
+	}
+	return 0;
+}
@@ -5,72 +5,958 @@
 #include <unistd.h>
 #include <errno.h>
 #include <stdint.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "lock.h"
+#include "probe.h"
+#include "smalloc.h"
+#include "tcache.h"
 
 #define DEBUG 0
 #define debug_print(...) \
 		do { if (DEBUG) fprintf(stderr, ##__VA_ARGS__); } while (0)
 
 #define MAX(x, y) (x > y ? x : y)
+#define MIN(x, y) (x < y ? x : y)
 
 /*
 Linked list allocator.
+
+The heap is a list of physically contiguous blocks. Every block starts with an
+8-byte header holding the size of the block, header included. Sizes are
+multiples of __ALIGN, so the low bits of the header are free to hold two flags:
+whether the block is free, and whether the block right before it is free. The
+next block is found by adding the size to the block address, so no next pointer
+is needed, and payloads stay 16-byte aligned:
+
+   8 mod 16     0 mod 16
+  [ size|flags | payload ...          ][ size|flags | payload ... ]
+
+A free block also keeps its size in its last word (the footer). Allocated
+blocks don't need one, the PREV_FREE flag tells whether the word before a
+header is a footer.
+
+Memory from sbrk is kept in segments of contiguous blocks. A segment starts with
+a link to the next segment and ends with a zero-size allocated epilogue header.
+The heap grows in chunks, starting at __CHUNK_SIZE and doubling up to
+__MAX_CHUNK_SIZE, so that warming up does not cost one syscall per block. New
+blocks are carved from the unused tail of the last segment, which lies between
+its epilogue (top) and the end of the chunk. As long as nobody else moves the
+program break, a new chunk extends the last segment.
+
+Requests are rounded up to a multiple of __ALIGN, header included. A free block
+that is larger than needed is split, and the remainder goes back to the free
+blocks. On free, a block is merged with free neighbours, and with the unused
+tail when it is the last block of the heap.
+
+Free blocks of at least __LARGE_SIZE bytes are indexed by size in an AVL tree so
+that large requests get the smallest block that fits (best-fit) in O(log n),
+instead of whatever block happens to come first. The tree node is stored in the
+payload of the free block, so the index costs no extra memory.
+
+How small blocks are placed is chosen at build time with LL_POLICY:
+
+  LL_ADDRESS_FIT  first fit in address order, walking the blocks from the
+                  start of the heap (the default).
+  LL_NEXT_FIT     like LL_ADDRESS_FIT, but the walk starts where the previous
+                  one left off (the rover) and wraps around.
+  LL_FIRST_FIT    first fit on a LIFO list of free blocks.
+  LL_BEST_FIT     best fit on per-size lists of free blocks, one for every
+                  multiple of __ALIGN below __LARGE_SIZE, found through a
+                  bitmap of the non-empty lists.
+
+The list-based policies keep their links in the payload of free blocks, which
+makes the smallest block 32 bytes instead of 16. Small requests that the policy
+can't satisfy are split off the best-fitting large block.
+
+cc -DLL_POLICY=LL_NEXT_FIT ...
+
+Built with -DLL_OOB, headers and footers are kept out of line instead, in a
+side array with one 32-bit entry per __ALIGN bytes of heap, reserved in a
+mapping of its own. The entry of a block is at the index of its first __ALIGN
+and its footer at the index of its last, so blocks have no header and the
+smallest block is __ALIGN bytes of payload. Splitting, merging and freeing then
+write to the side array only, which leaves the pages of allocated blocks alone:
+after fork(), a child that frees its parent's blocks copies a few pages of the
+side array instead of every page it frees into. The tree nodes of large free
+blocks are kept in the side array too, in the entries after the header, which
+are unused while the block is free. Walks and tree searches then scan the dense
+side array, where the entries of small neighbouring blocks share cache lines,
+and never touch the blocks themselves. That is what makes it safe to give the
+pages of freed blocks of at least __PURGE_MIN bytes back to the OS right away.
+Only the list-based policies and the thread cache still link small free blocks
+through their payload, and the thread cache is on by default: a child that
+frees into it copies the pages as if the headers were in line, so only a
+-DNO_TCACHE build gets the savings (see make bench-fork). The side array costs
+a quarter of the heap for the smallest blocks, and covers __OOB_SPAN bytes of
+heap.
+
+All of the above is protected by a single lock, see lock.h. Blocks of up to
+__TCACHE_MAX_SIZE bytes are served from the thread cache in tcache.c, with one
+bin per multiple of __ALIGN, so most small requests don't take the lock. Build
+with -DNO_TCACHE to go to the list directly, or with -DTCACHE_PERCPU to cache
+per CPU instead of per thread.
+
+The lock is also taken around fork(), so that the child starts with a
+consistent heap whatever the other threads of the parent were doing.
+
+Allocations, frees, copies, exhaustion and growth have static tracepoints, see
+probe.h.
 */
 
-typedef struct list_head_t {
-	struct list_head_t *next;
-	size_t size;
-	size_t isfree;
-} list_head_t;
+#define LL_ADDRESS_FIT 0
+#define LL_NEXT_FIT 1
+#define LL_FIRST_FIT 2
+#define LL_BEST_FIT 3
+
+#ifndef LL_POLICY
+#define LL_POLICY LL_ADDRESS_FIT
+#endif
+
+#define LL_LINKED (LL_POLICY == LL_FIRST_FIT || LL_POLICY == LL_BEST_FIT)
+
+#define __ALIGN (16)
+#ifdef LL_OOB
+#define __HDR_SIZE (0)
+// Heap span covered by the side array, and the largest block an entry holds.
+#define __OOB_SPAN ((size_t)1 << 36)
+#define __MAX_REQUEST (((size_t)UINT32_MAX << 2) - __ALIGN)
+#define __PAGE_SIZE (4096)
+#define __PURGE_MIN (64*1024)
+#else
+#define __HDR_SIZE (sizeof(size_t))
+#define __MAX_REQUEST ((size_t)PTRDIFF_MAX)
+#endif
+#if LL_LINKED
+#define __MIN_BLOCK (2*__ALIGN)
+#else
+#define __MIN_BLOCK (__ALIGN)
+#endif
+#define __LARGE_SIZE (4096)
+#define __CHUNK_SIZE (64*1024)
+#define __MAX_CHUNK_SIZE (16*1024*1024)
+#define __TCACHE_MAX_SIZE (512)
+
+#define FREE ((size_t)1)
+#define PREV_FREE ((size_t)2)
+#define FLAGS (FREE | PREV_FREE)
+
+typedef struct block_t {
+	size_t hdr;
+} block_t;
+
+typedef struct segment_t {
+	struct segment_t *next;
+} segment_t;
+
+typedef struct free_link_t {
+	struct free_link_t *next;
+	struct free_link_t *prev;
+} free_link_t;
+
+// Out of line, tree nodes are packed into the side array right after the
+// header entry, which only guarantees 4-byte alignment.
+typedef struct tree_node_t {
+	struct tree_node_t *left;
+	struct tree_node_t *right;
+	size_t height;
+}
+#ifdef LL_OOB
+__attribute__((packed))
+#endif
+tree_node_t;
+
+static lock_t lock = LOCK_INITIALIZER;
+
+#ifdef LL_OOB
+// One header entry per __ALIGN bytes of heap, from oob_base on.
+static uint32_t *oob = NULL;
+static char *oob_base = NULL;
+#endif
+
+static segment_t *first_segment = NULL;
+static segment_t *last_segment = NULL;
+
+// Epilogue of the last segment, where the next block is carved.
+static block_t *top = NULL;
+
+// End of the last chunk, i.e. where the program break was last left by us.
+static char *heap_end = NULL;
+static size_t chunk_size = __CHUNK_SIZE;
+
+// Bytes taken with sbrk, bytes in allocated blocks, and calls to sbrk, mmap
+// and madvise. Written under the lock and read without it by
+// smalloc_heap_stats().
+static size_t heap_size = 0;
+static size_t allocated = 0;
+static size_t syscalls = 0;
+
+// Root of the size-ordered tree of free blocks of at least __LARGE_SIZE.
+static tree_node_t *large_root = NULL;
+
+// Number of free blocks smaller than __LARGE_SIZE. While there are none, the
+// search for a small block is skipped.
+static size_t small_free = 0;
+
+#if LL_POLICY == LL_NEXT_FIT
+// Where the previous walk stopped, and the segment it is in.
+static block_t *rover = NULL;
+static segment_t *rover_segment = NULL;
+#elif LL_POLICY == LL_FIRST_FIT
+static free_link_t *small_list = NULL;
+#elif LL_POLICY == LL_BEST_FIT
+#define __NBINS (__LARGE_SIZE/__ALIGN)
+static free_link_t *bins[__NBINS];
+static uint64_t bin_map[__NBINS/64];
+#endif
+
+// Adds bytes to the counter at c. Must hold the lock.
+static void
+heap_count(size_t *c, ssize_t bytes)
+{
+	__atomic_store_n(c, *c + bytes, __ATOMIC_RELAXED);
+}
+
+#ifdef LL_OOB
+static uint32_t*
+block_entry(block_t *b)
+{
+	return &oob[((char*)(b) - oob_base) / __ALIGN];
+}
+
+// Entries hold the size in units of 4 bytes, which leaves the low bits for the
+// flags as in a header.
+static size_t
+block_hdr(block_t *b)
+{
+	uint32_t e = *block_entry(b);
+	return ((size_t)(e & ~FLAGS) << 2) | (e & FLAGS);
+}
 
-// Head is a zero-size sentinel dummy that starts the linked list chain.
-static list_head_t head;
+static void
+block_set_hdr(block_t *b, size_t hdr)
+{
+	*block_entry(b) = (uint32_t)(((hdr & ~FLAGS) >> 2) | (hdr & FLAGS));
+}
 
+// Returns the size of the free block right before b.
 static size_t
-pow2_ceil(size_t x)
+block_prev_size(block_t *b)
 {
-	// https://graphics.stanford.edu/~seander/bithacks.html#RoundUpPowerOf2
-	x--;
-	x |= x >> 1;
-	x |= x >> 2;
-	x |= x >> 4;
-	x |= x >> 8;
-	x |= x >> 16;
-	x++;
-	return x;
+	return (size_t)(block_entry(b)[-1] & ~FLAGS) << 2;
 }
 
-static list_head_t*
-alloc_block(size_t size)
+static void
+block_set_footer(block_t *b, size_t size)
 {
-	void *ptr = sbrk(sizeof(list_head_t)+size);
-	if (ptr == (void *)-1) {
-		return NULL;
+	// The footer of a block of one __ALIGN is its header, which holds the
+	// size already.
+	if (size > __ALIGN) {
+		block_entry(b)[size / __ALIGN - 1] = (uint32_t)(size >> 2);
+	}
+}
+
+// Reserves the side array on first use, and checks that it covers the heap
+// between start and end.
+static int
+oob_cover(char *start, char *end)
+{
+	if (oob == NULL) {
+		void *m = mmap(NULL, (__OOB_SPAN / __ALIGN + 1) * sizeof(uint32_t), PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		heap_count(&syscalls, 1);
+		if (m == MAP_FAILED) {
+			return -1;
+		}
+		PROBE2(grow, m, (__OOB_SPAN / __ALIGN + 1) * sizeof(uint32_t));
+		oob = m;
+		oob_base = start;
 	}
+	return start >= oob_base && end <= oob_base + __OOB_SPAN ? 0 : -1;
+}
+#else
+static size_t
+block_hdr(block_t *b)
+{
+	return b->hdr;
+}
 
-	list_head_t *l = (list_head_t*)ptr;
-	memset(l, 0, sizeof(list_head_t));
-	l->size = size;
+static void
+block_set_hdr(block_t *b, size_t hdr)
+{
+	b->hdr = hdr;
+}
+
+static size_t
+block_prev_size(block_t *b)
+{
+	return *((size_t*)(b) - 1);
+}
+
+static void
+block_set_footer(block_t *b, size_t size)
+{
+	*(size_t*)((char*)(b) + size - sizeof(size_t)) = size;
+}
+
+static int
+oob_cover(char *start, char *end)
+{
+	(void)start;
+	(void)end;
+	return 0;
+}
+#endif
+
+static size_t
+block_size(block_t *b)
+{
+	return block_hdr(b) & ~FLAGS;
+}
+
+static int
+block_isfree(block_t *b)
+{
+	return (block_hdr(b) & FREE) != 0;
+}
+
+static block_t*
+block_next(block_t *b)
+{
+	return (block_t*)((char*)(b) + block_size(b));
+}
+
+static void*
+block_payload(block_t *b)
+{
+	return (char*)(b) + __HDR_SIZE;
+}
+
+static block_t*
+payload_block(void *ptr)
+{
+	return (block_t*)((char*)(ptr) - __HDR_SIZE);
+}
+
+static block_t*
+segment_first(segment_t *s)
+{
+	return (block_t*)((char*)(s) + __ALIGN - __HDR_SIZE);
+}
+
+static void
+block_set_free(block_t *b)
+{
+	size_t size = block_size(b);
+	block_set_hdr(b, block_hdr(b) | FREE);
+	block_set_footer(b, size);
+	block_t *next = block_next(b);
+	block_set_hdr(next, block_hdr(next) | PREV_FREE);
+}
+
+static void
+block_set_used(block_t *b)
+{
+	block_set_hdr(b, block_hdr(b) & ~FREE);
+	block_t *next = block_next(b);
+	block_set_hdr(next, block_hdr(next) & ~PREV_FREE);
+}
+
+// Gives the whole pages of a block that is being freed back to the OS. Out of
+// line, nothing is kept in large free blocks, so they stay untouched until
+// they are handed out again.
+static void
+block_purge(block_t *b)
+{
+#ifdef LL_OOB
+	size_t size = block_size(b);
+	if (size < __PURGE_MIN) {
+		return;
+	}
+	uintptr_t start = ((uintptr_t)(b) + __PAGE_SIZE - 1) & ~(uintptr_t)(__PAGE_SIZE - 1);
+	uintptr_t end = ((uintptr_t)(b) + size) & ~(uintptr_t)(__PAGE_SIZE - 1);
+	madvise((void*)start, end - start, MADV_DONTNEED);
+	heap_count(&syscalls, 1);
+#else
+	(void)b;
+#endif
+}
+
+#ifdef LL_OOB
+// A free block of __LARGE_SIZE bytes spans enough entries to hold its node
+// between its header and its footer.
+static tree_node_t*
+block_node(block_t *b)
+{
+	return (tree_node_t*)(block_entry(b) + 1);
+}
+
+static block_t*
+node_block(tree_node_t *n)
+{
+	return (block_t*)(oob_base + ((uint32_t*)(n) - 1 - oob) * __ALIGN);
+}
+#else
+static tree_node_t*
+block_node(block_t *b)
+{
+	return block_payload(b);
+}
+
+static block_t*
+node_block(tree_node_t *n)
+{
+	return payload_block(n);
+}
+#endif
+
+static size_t
+node_size(tree_node_t *n)
+{
+	return block_size(node_block(n));
+}
+
+static size_t
+node_height(tree_node_t *n)
+{
+	return n == NULL ? 0 : n->height;
+}
+
+// Nodes are ordered by size, with ties broken by address so that blocks of
+// equal size can coexist in the tree.
+static int
+node_less(tree_node_t *a, tree_node_t *b)
+{
+	size_t sa = node_size(a);
+	size_t sb = node_size(b);
+	return sa < sb || (sa == sb && (uintptr_t)a < (uintptr_t)b);
+}
+
+static void
+node_update(tree_node_t *n)
+{
+	n->height = 1 + MAX(node_height(n->left), node_height(n->right));
+}
+
+static tree_node_t*
+rotate_left(tree_node_t *n)
+{
+	tree_node_t *r = n->right;
+	n->right = r->left;
+	r->left = n;
+	node_update(n);
+	node_update(r);
+	return r;
+}
+
+static tree_node_t*
+rotate_right(tree_node_t *n)
+{
+	tree_node_t *l = n->left;
+	n->left = l->right;
+	l->right = n;
+	node_update(n);
+	node_update(l);
 	return l;
 }
 
-static list_head_t*
+static tree_node_t*
+tree_rebalance(tree_node_t *n)
+{
+	node_update(n);
+	size_t lh = node_height(n->left);
+	size_t rh = node_height(n->right);
+	if (lh > rh + 1) {
+		if (node_height(n->left->left) < node_height(n->left->right)) {
+			n->left = rotate_left(n->left);
+		}
+		return rotate_right(n);
+	}
+	if (rh > lh + 1) {
+		if (node_height(n->right->right) < node_height(n->right->left)) {
+			n->right = rotate_right(n->right);
+		}
+		return rotate_left(n);
+	}
+	return n;
+}
+
+static tree_node_t*
+tree_insert(tree_node_t *root, tree_node_t *n)
+{
+	if (root == NULL) {
+		n->left = NULL;
+		n->right = NULL;
+		n->height = 1;
+		return n;
+	}
+	if (node_less(n, root)) {
+		root->left = tree_insert(root->left, n);
+	} else {
+		root->right = tree_insert(root->right, n);
+	}
+	return tree_rebalance(root);
+}
+
+static tree_node_t*
+tree_remove_min(tree_node_t *root, tree_node_t **min)
+{
+	if (root->left == NULL) {
+		*min = root;
+		return root->right;
+	}
+	root->left = tree_remove_min(root->left, min);
+	return tree_rebalance(root);
+}
+
+static tree_node_t*
+tree_remove(tree_node_t *root, tree_node_t *n)
+{
+	if (root == NULL) {
+		return NULL;
+	}
+	if (root == n) {
+		if (root->left == NULL) {
+			return root->right;
+		}
+		if (root->right == NULL) {
+			return root->left;
+		}
+		tree_node_t *min;
+		tree_node_t *right = tree_remove_min(root->right, &min);
+		min->left = root->left;
+		min->right = right;
+		return tree_rebalance(min);
+	}
+	if (node_less(n, root)) {
+		root->left = tree_remove(root->left, n);
+	} else {
+		root->right = tree_remove(root->right, n);
+	}
+	return tree_rebalance(root);
+}
+
+// Returns the smallest node that can hold size bytes, or NULL.
+static tree_node_t*
+tree_best_fit(tree_node_t *root, size_t size)
+{
+	tree_node_t *best = NULL;
+	while (root != NULL) {
+		if (node_size(root) >= size) {
+			best = root;
+			root = root->left;
+		} else {
+			root = root->right;
+		}
+	}
+	return best;
+}
+
+#if LL_LINKED
+static void
+link_push(free_link_t **list, free_link_t *l)
+{
+	l->prev = NULL;
+	l->next = *list;
+	if (*list != NULL) {
+		(*list)->prev = l;
+	}
+	*list = l;
+}
+
+static void
+link_remove(free_link_t **list, free_link_t *l)
+{
+	if (l->prev != NULL) {
+		l->prev->next = l->next;
+	} else {
+		*list = l->next;
+	}
+	if (l->next != NULL) {
+		l->next->prev = l->prev;
+	}
+}
+#endif
+
+static void
+small_insert(block_t *b)
+{
+	small_free++;
+#if LL_POLICY == LL_FIRST_FIT
+	link_push(&small_list, block_payload(b));
+#elif LL_POLICY == LL_BEST_FIT
+	size_t i = block_size(b) / __ALIGN;
+	link_push(&bins[i], block_payload(b));
+	bin_map[i / 64] |= (uint64_t)1 << (i % 64);
+#else
+	(void)b;
+#endif
+}
+
+static void
+small_remove(block_t *b)
+{
+	small_free--;
+#if LL_POLICY == LL_FIRST_FIT
+	link_remove(&small_list, block_payload(b));
+#elif LL_POLICY == LL_BEST_FIT
+	size_t i = block_size(b) / __ALIGN;
+	link_remove(&bins[i], block_payload(b));
+	if (bins[i] == NULL) {
+		bin_map[i / 64] &= ~((uint64_t)1 << (i % 64));
+	}
+#else
+	(void)b;
+#endif
+}
+
+// Returns a free block smaller than __LARGE_SIZE that can hold size bytes,
+// taken out of the index, or NULL.
+static block_t*
+small_find(size_t size)
+{
+	if (small_free == 0) {
+		return NULL;
+	}
+#if LL_POLICY == LL_ADDRESS_FIT
+	// Large free blocks are left to the tree, the walk only considers small
+	// ones.
+	for (segment_t *s = first_segment; s != NULL; s = s->next) {
+#ifdef LL_OOB
+		// Walk the entries themselves. An entry holds the size over 4, so
+		// the next block's entry is e >> 2 entries on. The epilogue's entry
+		// may still carry PREV_FREE.
+		for (uint32_t *e = block_entry(segment_first(s)); (*e & ~FLAGS) != 0; e += *e >> 2) {
+			// A few cache lines ahead, since small blocks have entries
+			// close together.
+			__builtin_prefetch(e + 64);
+			size_t bsize = (size_t)(*e & ~FLAGS) << 2;
+			if ((*e & FREE) && bsize >= size && bsize < __LARGE_SIZE) {
+				block_t *b = (block_t*)(oob_base + (e - oob) * __ALIGN);
+				small_remove(b);
+				return b;
+			}
+		}
+#else
+		for (block_t *b = segment_first(s); block_size(b) != 0; b = block_next(b)) {
+			if (block_isfree(b) && block_size(b) >= size && block_size(b) < __LARGE_SIZE) {
+				small_remove(b);
+				return b;
+			}
+		}
+#endif
+	}
+#elif LL_POLICY == LL_NEXT_FIT
+	if (rover == NULL) {
+		rover_segment = first_segment;
+		rover = segment_first(rover_segment);
+	}
+	segment_t *s = rover_segment;
+	block_t *b = rover;
+	int wrapped = 0;
+	for (;;) {
+		if (block_size(b) == 0) {
+			if (wrapped && s == rover_segment) {
+				break;
+			}
+			s = s->next;
+			if (s == NULL) {
+				if (wrapped) {
+					break;
+				}
+				wrapped = 1;
+				s = first_segment;
+			}
+			b = segment_first(s);
+			continue;
+		}
+		if (wrapped && b == rover) {
+			break;
+		}
+		if (block_isfree(b) && block_size(b) >= size && block_size(b) < __LARGE_SIZE) {
+			small_remove(b);
+			rover = b;
+			rover_segment = s;
+			return b;
+		}
+		b = block_next(b);
+	}
+#elif LL_POLICY == LL_FIRST_FIT
+	for (free_link_t *l = small_list; l != NULL; l = l->next) {
+		block_t *b = payload_block(l);
+		if (block_size(b) >= size) {
+			small_remove(b);
+			return b;
+		}
+	}
+#elif LL_POLICY == LL_BEST_FIT
+	size_t i = size / __ALIGN;
+	size_t w = i / 64;
+	uint64_t mask = bin_map[w] & (~(uint64_t)0 << (i % 64));
+	while (mask == 0) {
+		if (++w == __NBINS/64) {
+			return NULL;
+		}
+		mask = bin_map[w];
+	}
+	block_t *b = payload_block(bins[w*64 + __builtin_ctzll(mask)]);
+	small_remove(b);
+	return b;
+#endif
+	return NULL;
+}
+
+static void
+unindex_block(block_t *b)
+{
+	if (block_size(b) >= __LARGE_SIZE) {
+		large_root = tree_remove(large_root, block_node(b));
+	} else {
+		small_remove(b);
+	}
+}
+
+static void
+release_block(block_t *b)
+{
+	block_set_free(b);
+	if (block_size(b) >= __LARGE_SIZE) {
+		large_root = tree_insert(large_root, block_node(b));
+	} else {
+		small_insert(b);
+	}
+}
+
+// Merges b with its free neighbours. The neighbours are taken out of the index
+// and the merged block is returned.
+static block_t*
+coalesce_block(block_t *b)
+{
+	block_t *next = block_next(b);
+	if (block_size(next) != 0 && block_isfree(next)) {
+		unindex_block(next);
+		block_set_hdr(b, block_hdr(b) + block_size(next));
+#if LL_POLICY == LL_NEXT_FIT
+		if (rover == next) {
+			rover = b;
+		}
+#endif
+	}
+	if (block_hdr(b) & PREV_FREE) {
+		block_t *prev = (block_t*)((char*)(b) - block_prev_size(b));
+		unindex_block(prev);
+		block_set_hdr(prev, block_hdr(prev) + block_size(b));
+#if LL_POLICY == LL_NEXT_FIT
+		if (rover == b) {
+			rover = prev;
+		}
+#endif
+		b = prev;
+	}
+	return b;
+}
+
+// Shrinks the free block b to size bytes, releasing the remainder if it is
+// large enough to form a block of its own.
+static void
+split_block(block_t *b, size_t size)
+{
+	size_t rest = block_size(b) - size;
+	if (rest < __MIN_BLOCK) {
+		return;
+	}
+	block_set_hdr(b, size | (block_hdr(b) & FLAGS));
+	block_t *r = block_next(b);
+	block_set_hdr(r, rest);
+	release_block(r);
+}
+
+// Makes room for at least size more bytes after top by moving the program
+// break by a whole chunk.
+static int
+grow_heap(size_t size)
+{
+	size_t chunk = chunk_size;
+	while (chunk < size + sizeof(segment_t) + __ALIGN) {
+		// No break can move that far, and doubling would overflow.
+		if (chunk > SIZE_MAX / 2) {
+			return -1;
+		}
+		chunk *= 2;
+	}
+	chunk_size = MAX(chunk_size, MIN(chunk * 2, __MAX_CHUNK_SIZE));
+
+	char *brk = sbrk(0);
+	if (top != NULL && brk == heap_end) {
+		if (oob_cover(heap_end, heap_end + chunk) != 0) {
+			return -1;
+		}
+		heap_count(&syscalls, 1);
+		if (sbrk(chunk) == (void *)-1) {
+			return -1;
+		}
+		PROBE2(grow, heap_end, chunk);
+		heap_end += chunk;
+		heap_count(&heap_size, chunk);
+		return 0;
+	}
+
+	size_t pad = (__ALIGN - (uintptr_t)(brk) % __ALIGN) % __ALIGN;
+	if (oob_cover(brk + pad, brk + pad + chunk) != 0) {
+		return -1;
+	}
+	char *ptr = sbrk(pad + chunk);
+	heap_count(&syscalls, 1);
+	if (ptr == (void *)-1) {
+		return -1;
+	}
+	PROBE2(grow, ptr, pad + chunk);
+	heap_count(&heap_size, pad + chunk);
+	if (top != NULL) {
+		// Someone else moved the break, so the tail of the last segment
+		// can't be extended. Hand it out as a free block instead.
+		size_t rest = (size_t)(heap_end - (char*)(top)) - __HDR_SIZE;
+		if (rest >= __MIN_BLOCK) {
+			block_t *b = top;
+			block_set_hdr(b, rest | (block_hdr(b) & PREV_FREE));
+			top = block_next(b);
+			block_set_hdr(top, 0);
+			release_block(coalesce_block(b));
+		}
+	}
+	segment_t *s = (segment_t*)(ptr + pad);
+	s->next = NULL;
+	if (last_segment != NULL) {
+		last_segment->next = s;
+	} else {
+		first_segment = s;
+	}
+	last_segment = s;
+	top = segment_first(s);
+	block_set_hdr(top, 0);
+	heap_end = ptr + pad + chunk;
+	debug_print("grow_heap segment:%p size:%ld\n", (void*)s, chunk);
+	return 0;
+}
+
+// Carves a block of size bytes from the tail of the last segment, returning
+// it marked as allocated.
+static block_t*
+alloc_block(size_t size)
+{
+	if (top == NULL || (size_t)(heap_end - (char*)(top)) < size + __HDR_SIZE) {
+		if (grow_heap(size) != 0) {
+			return NULL;
+		}
+	}
+	block_t *b = top;
+	block_set_hdr(b, size | (block_hdr(b) & PREV_FREE));
+	top = block_next(b);
+	block_set_hdr(top, 0);
+	return b;
+}
+
+// Returns the size of the block that holds a request of size bytes.
+static size_t
+request_block_size(size_t size)
+{
+	size = (size + __HDR_SIZE + __ALIGN - 1) & ~(size_t)(__ALIGN - 1);
+	return MAX(__MIN_BLOCK, size);
+}
+
+// Returns an allocated block of size bytes. Must hold the lock.
+static block_t*
 find_block(size_t size)
 {
-	list_head_t *prev = &head;
-	list_head_t *curr = prev->next;
-	size = MAX(8, pow2_ceil(size));
-	while (curr != NULL && (curr->isfree == 0 || curr->size < size)) {
-		prev = curr;
-		curr = curr->next;
+	block_t *b = NULL;
+	if (size < __LARGE_SIZE) {
+		b = small_find(size);
+	}
+	if (b == NULL) {
+		tree_node_t *n = tree_best_fit(large_root, size);
+		if (n != NULL) {
+			large_root = tree_remove(large_root, n);
+			b = node_block(n);
+		}
+	}
+	if (b == NULL) {
+		PROBE2(exhausted, size, 0);
+		b = alloc_block(size);
+		if (b == NULL) {
+			return NULL;
+		}
+	} else {
+		split_block(b, size);
+		block_set_used(b);
+	}
+	heap_count(&allocated, block_size(b));
+	return b;
+}
+
+// Carves n blocks of size bytes into ptrs out of a single block of n*size
+// bytes, which takes one search and one split. Returns n, or 0 if there is no
+// such block. Must hold the lock.
+static size_t
+find_run(size_t size, size_t n, void **ptrs)
+{
+	block_t *b = find_block(size * n);
+	if (b == NULL) {
+		return 0;
 	}
-	if (curr != NULL) {
-		curr->isfree = 0;
-		return curr;
+	// The last block gets whatever was too small to split off.
+	size_t total = block_size(b);
+	size_t flags = block_hdr(b) & PREV_FREE;
+	for (size_t i = 0; i < n; i++) {
+		block_t *c = (block_t*)((char*)(b) + i * size);
+		block_set_hdr(c, (i + 1 < n ? size : total - i * size) | (i == 0 ? flags : 0));
+		ptrs[i] = block_payload(c);
 	}
-	prev->next = alloc_block(size);
-	return prev->next;
+	return n;
 }
 
+// Gives block b back to the heap. Must hold the lock.
+static void
+free_block(block_t *b)
+{
+	heap_count(&allocated, -(ssize_t)block_size(b));
+	block_purge(b);
+	b = coalesce_block(b);
+	if (block_next(b) == top) {
+		// Give the block back to the unused tail.
+		block_set_hdr(b, 0);
+		top = b;
+		return;
+	}
+	release_block(b);
+}
+
+size_t
+backend_malloc_batch(size_t size, size_t n, void **ptrs)
+{
+	size = request_block_size(size);
+	size_t i = 0;
+	lock_acquire(&lock);
+	for (; i < n; i++) {
+		block_t *b = find_block(size);
+		if (b == NULL) {
+			break;
+		}
+		ptrs[i] = block_payload(b);
+	}
+	lock_release(&lock);
+	return i;
+}
+
+void
+backend_free_batch(void **ptrs, size_t n)
+{
+	lock_acquire(&lock);
+	for (size_t i = 0; i < n; i++) {
+		free_block(payload_block(ptrs[i]));
+	}
+	lock_release(&lock);
+}
 
 void*
 malloc(size_t size)
@@ -78,8 +964,31 @@ malloc(size_t size)
 	if (size == 0) {
 		return NULL;
 	}
-	list_head_t *block = find_block(size);
-	return block+1;
+	if (size > __MAX_REQUEST) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	size_t need = request_block_size(size);
+#ifndef NO_TCACHE
+	if (need <= __TCACHE_MAX_SIZE) {
+		void *ptr = tcache_malloc(need / __ALIGN - 1, need - __HDR_SIZE);
+		if (ptr == NULL) {
+			errno = ENOMEM;
+		}
+		PROBE2(malloc, ptr, size);
+		return ptr;
+	}
+#endif
+	lock_acquire(&lock);
+	block_t *b = find_block(need);
+	lock_release(&lock);
+	if (b == NULL) {
+		errno = ENOMEM;
+		PROBE2(malloc, NULL, size);
+		return NULL;
+	}
+	PROBE2(malloc, block_payload(b), size);
+	return block_payload(b);
 }
 
 
@@ -89,9 +998,15 @@ free(void *ptr)
 	if (ptr == NULL) {
 		return;
 	}
-	list_head_t *l = (list_head_t*)(ptr) - 1;
-	l->isfree = 1;
-	return;
+	PROBE1(free, ptr);
+#ifndef NO_TCACHE
+	size_t size = block_size(payload_block(ptr));
+	if (size <= __TCACHE_MAX_SIZE) {
+		tcache_free(size / __ALIGN - 1, ptr);
+		return;
+	}
+#endif
+	backend_free_batch(&ptr, 1);
 }
 
 void
@@ -105,8 +1020,8 @@ void
 		return NULL;
 	}
 
-	list_head_t *l = (list_head_t*)(ptr) - 1;
-	if (size <= l->size) {
+	size_t old_size = block_size(payload_block(ptr)) - __HDR_SIZE;
+	if (size <= old_size) {
 		return ptr;
 	}
 
@@ -115,7 +1030,8 @@ void
 		return ptr;
 	}
 
-	memcpy(new_ptr, ptr, l->size);
+	PROBE3(realloc_copy, ptr, new_ptr, old_size);
+	memcpy(new_ptr, ptr, old_size);
 	free(ptr);
 	return new_ptr;
 }
@@ -131,3 +1047,187 @@ void
 	memset(ptr, 0, rqsize);
 	return ptr;
 }
+
+size_t
+smalloc_batch(size_t size, size_t n, void **ptrs)
+{
+	if (size == 0) {
+		return 0;
+	}
+	if (size > __MAX_REQUEST) {
+		errno = ENOMEM;
+		return 0;
+	}
+#ifndef NO_TCACHE
+	// Short batches are served best by the thread cache.
+	if (n <= TCACHE_MAX_COUNT) {
+		size_t i = 0;
+		while (i < n && (ptrs[i] = malloc(size)) != NULL) {
+			i++;
+		}
+		return i;
+	}
+#endif
+	// Longer ones are taken straight from the heap, in runs of up to
+	// __MAX_CHUNK_SIZE bytes.
+	size = request_block_size(size);
+	size_t run = MAX(__MAX_CHUNK_SIZE / size, 1);
+	size_t i = 0;
+	lock_acquire(&lock);
+	while (i < n) {
+		size_t k = find_run(size, MIN(run, n - i), &ptrs[i]);
+		if (k == 0) {
+			// There may still be room for single blocks.
+			block_t *b = find_block(size);
+			if (b == NULL) {
+				break;
+			}
+			ptrs[i] = block_payload(b);
+			k = 1;
+		}
+		i += k;
+	}
+	lock_release(&lock);
+	if (i < n) {
+		errno = ENOMEM;
+	}
+	return i;
+}
+
+static int
+ptr_cmp(const void *a, const void *b)
+{
+	uintptr_t x = (uintptr_t)(*(void *const *)a);
+	uintptr_t y = (uintptr_t)(*(void *const *)b);
+	return (x > y) - (x < y);
+}
+
+// Sorts ptrs by address, unless they already are.
+static void
+sort_ptrs(void **ptrs, size_t n)
+{
+	for (size_t i = 1; i < n; i++) {
+		if ((uintptr_t)(ptrs[i - 1]) > (uintptr_t)(ptrs[i])) {
+			qsort(ptrs, n, sizeof(void*), ptr_cmp);
+			return;
+		}
+	}
+}
+
+void
+sfree_batch(void **ptrs, size_t n)
+{
+	// Sorted, blocks that follow each other in the heap are next to each
+	// other in ptrs, and each such run is freed as a single block. NULLs end
+	// up first.
+#ifndef NO_TCACHE
+	if (n <= TCACHE_MAX_COUNT) {
+		for (size_t i = 0; i < n; i++) {
+			free(ptrs[i]);
+		}
+		return;
+	}
+#endif
+	sort_ptrs(ptrs, n);
+	size_t i = 0;
+	while (i < n && ptrs[i] == NULL) {
+		i++;
+	}
+	lock_acquire(&lock);
+	while (i < n) {
+		block_t *b = payload_block(ptrs[i]);
+		size_t size = block_size(b);
+		size_t j = i + 1;
+		while (j < n && payload_block(ptrs[j]) == (block_t*)((char*)(b) + size)) {
+			size += block_size(payload_block(ptrs[j]));
+			j++;
+		}
+		block_set_hdr(b, size | (block_hdr(b) & PREV_FREE));
+#if LL_POLICY == LL_NEXT_FIT
+		// The headers inside the run are gone, and the run is within a
+		// single segment.
+		if (rover > b && (char*)(rover) < (char*)(b) + size) {
+			rover = b;
+		}
+#endif
+		free_block(b);
+		i = j;
+	}
+	lock_release(&lock);
+}
+
+size_t
+smalloc_lock_stats(smalloc_lock_stats_t *stats, size_t n)
+{
+	if (n > 0) {
+		lock_stats(&lock, &stats[0]);
+	}
+	return 1;
+}
+
+void
+smalloc_heap_stats(smalloc_heap_stats_t *stats)
+{
+	stats->footprint = __atomic_load_n(&heap_size, __ATOMIC_RELAXED);
+	stats->allocated = __atomic_load_n(&allocated, __ATOMIC_RELAXED);
+}
+
+void
+smalloc_info(smalloc_info_t *info)
+{
+	memset(info, 0, sizeof(*info));
+	info->nclasses = SMALLOC_INFO_CLASSES;
+	for (size_t i = 0; i < SMALLOC_INFO_CLASSES; i++) {
+		info->classes[i].size = (uint64_t)__ALIGN << i;
+	}
+	size_t nblocks = 0;
+	size_t nsegments = 0;
+	lock_acquire(&lock);
+	for (segment_t *s = first_segment; s != NULL; s = s->next) {
+		nsegments++;
+		for (block_t *b = segment_first(s); block_size(b) != 0; b = block_next(b)) {
+			nblocks++;
+			if (!block_isfree(b)) {
+				continue;
+			}
+			size_t size = block_size(b);
+			size_t c = 63 - __builtin_clzll(size / __ALIGN);
+			c = MIN(c, SMALLOC_INFO_CLASSES - 1);
+			info->classes[c].blocks++;
+			info->classes[c].bytes += size;
+			info->free += size;
+			info->free_blocks++;
+			info->largest_free = MAX(info->largest_free, size);
+		}
+	}
+	info->footprint = heap_size;
+	info->allocated = allocated;
+	info->top = top != NULL ? (size_t)(heap_end - (char*)(top)) : 0;
+	info->syscalls = syscalls;
+#ifdef LL_OOB
+	info->metadata = heap_size / __ALIGN * sizeof(uint32_t);
+#else
+	// Every block and every segment's epilogue has a header, and every
+	// segment a link.
+	info->metadata = (nblocks + nsegments) * __HDR_SIZE + nsegments * sizeof(segment_t);
+#endif
+	lock_release(&lock);
+}
+
+static void
+fork_prepare(void)
+{
+	lock_acquire(&lock);
+}
+
+static void
+fork_release(void)
+{
+	lock_release(&lock);
+}
+
+__attribute__((constructor)) static void
+fork_handlers_init(void)
+{
+	pthread_atfork(fork_prepare, fork_release, fork_release);
+}
@@ -0,0 +1,74 @@
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lock.h"
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#ifdef LOCK_PTHREAD
+void
+lock_acquire_slow(lock_t *l)
+{
+	uint64_t start = now_ns();
+	pthread_mutex_lock(&l->mutex);
+	__atomic_store_n(&l->contended, l->contended + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&l->wait_ns, l->wait_ns + now_ns() - start, __ATOMIC_RELAXED);
+}
+#else
+static void
+cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#endif
+}
+
+void
+lock_acquire_slow(lock_t *l)
+{
+	uint64_t start = now_ns();
+	uint32_t max_spin = __atomic_load_n(&l->spins, __ATOMIC_RELAXED) * 2 + 10;
+	if (max_spin > LOCK_MAX_SPIN) {
+		max_spin = LOCK_MAX_SPIN;
+	}
+
+	uint32_t spin = 0;
+	int acquired = 0;
+	for (; spin < max_spin; spin++) {
+		uint32_t expected = 0;
+		if (__atomic_load_n(&l->state, __ATOMIC_RELAXED) == 0 &&
+				__atomic_compare_exchange_n(&l->state, &expected, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			acquired = 1;
+			break;
+		}
+		cpu_relax();
+	}
+	if (!acquired) {
+		// Whoever releases the lock now sees 2 and wakes a waiter. Since we
+		// may have been that waiter, we keep 2 once we have the lock, which
+		// costs at most one needless wake.
+		while (__atomic_exchange_n(&l->state, 2, __ATOMIC_ACQUIRE) != 0) {
+			syscall(SYS_futex, &l->state, FUTEX_WAIT_PRIVATE, 2, NULL, NULL, 0);
+		}
+	}
+
+	int32_t spins = l->spins;
+	__atomic_store_n(&l->spins, spins + ((int32_t)spin - spins) / 8, __ATOMIC_RELAXED);
+	__atomic_store_n(&l->contended, l->contended + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&l->wait_ns, l->wait_ns + now_ns() - start, __ATOMIC_RELAXED);
+}
+
+void
+lock_wake(lock_t *l)
+{
+	syscall(SYS_futex, &l->state, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+#endif
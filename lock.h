@@ -0,0 +1,100 @@
+#ifndef LOCK_H
+#define LOCK_H
+
+#include <stdint.h>
+
+#ifdef LOCK_PTHREAD
+#include <pthread.h>
+#endif
+
+#include "smalloc.h"
+
+/*
+Lock used inside the allocator, with contention metrics.
+
+The lock word is 0 when the lock is free, 1 when it is held, and 2 when it is
+held and threads may be sleeping on it. Taking a free lock is one CAS. A thread
+that finds the lock held spins for a while, then sets the word to 2 and sleeps
+on a futex until the holder releases it. Only a release that sees 2 makes the
+futex syscall to wake one waiter, so uncontended locks never enter the kernel.
+
+How long to spin adapts per lock, like glibc's adaptive mutexes: the limit
+follows the number of spins that the recent contended acquires needed, up to
+LOCK_MAX_SPIN. Locks that are held for long quickly stop spinning.
+
+Every lock counts its acquires, the contended ones among them, and the time
+spent in contended acquires. They are read through smalloc_lock_stats().
+
+Build with -DLOCK_PTHREAD to use a pthread mutex instead, with the same
+metrics, for comparison.
+*/
+
+#define LOCK_MAX_SPIN (100)
+
+#define HIDDEN __attribute__((visibility("hidden")))
+
+typedef struct lock_t {
+#ifdef LOCK_PTHREAD
+	pthread_mutex_t mutex;
+#else
+	uint32_t state;
+	uint32_t spins;
+#endif
+	// Only written while holding the lock.
+	uint64_t acquires;
+	uint64_t contended;
+	uint64_t wait_ns;
+} lock_t;
+
+#ifdef LOCK_PTHREAD
+#define LOCK_INITIALIZER {PTHREAD_MUTEX_INITIALIZER, 0, 0, 0}
+#else
+#define LOCK_INITIALIZER {0, 0, 0, 0, 0}
+#endif
+
+HIDDEN void lock_acquire_slow(lock_t *l);
+HIDDEN void lock_wake(lock_t *l);
+
+static inline void
+lock_init(lock_t *l)
+{
+	*l = (lock_t)LOCK_INITIALIZER;
+}
+
+static inline void
+lock_acquire(lock_t *l)
+{
+#ifdef LOCK_PTHREAD
+	if (pthread_mutex_trylock(&l->mutex) != 0) {
+		lock_acquire_slow(l);
+	}
+#else
+	uint32_t expected = 0;
+	if (!__atomic_compare_exchange_n(&l->state, &expected, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+		lock_acquire_slow(l);
+	}
+#endif
+	__atomic_store_n(&l->acquires, l->acquires + 1, __ATOMIC_RELAXED);
+}
+
+static inline void
+lock_release(lock_t *l)
+{
+#ifdef LOCK_PTHREAD
+	pthread_mutex_unlock(&l->mutex);
+#else
+	if (__atomic_exchange_n(&l->state, 0, __ATOMIC_RELEASE) == 2) {
+		lock_wake(l);
+	}
+#endif
+}
+
+static inline void
+lock_stats(lock_t *l, smalloc_lock_stats_t *stats)
+{
+	stats->acquires = __atomic_load_n(&l->acquires, __ATOMIC_RELAXED);
+	stats->contended = __atomic_load_n(&l->contended, __ATOMIC_RELAXED);
+	stats->wait_ns = __atomic_load_n(&l->wait_ns, __ATOMIC_RELAXED);
+}
+
+#endif
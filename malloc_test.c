@@ -1,9 +1,20 @@
 #include "unity/unity.h"
+#include "smalloc.h"
 
 #include <errno.h>
+#include <malloc.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
+#ifdef LL_OOB
+#include <sys/mman.h>
+#endif
+#ifdef TEST_THREADS
+#include <pthread.h>
+#include <sys/wait.h>
+#endif
 
 void setUp(void)
 {
@@ -59,6 +70,566 @@ static void test_malloc_many(void)
   }
 }
 
+static void test_malloc_mixed_sizes(void)
+{
+  // TEST_IGNORE();
+  unsigned char *ptr[32] = {0};
+  size_t size[32] = {0};
+  uint32_t seed = 1;
+  for (size_t i = 0; i < 1e4; i++) {
+    seed = seed * 1103515245 + 12345;
+    size_t slot = (seed >> 16) % 32;
+    if (ptr[slot] != NULL) {
+      TEST_ASSERT_EACH_EQUAL_UINT8((unsigned char)slot, ptr[slot], size[slot]);
+      free(ptr[slot]);
+    }
+    seed = seed * 1103515245 + 12345;
+    size[slot] = 1 + (seed >> 16) % (1024*8);
+    ptr[slot] = malloc(size[slot]);
+    TEST_ASSERT_NOT_NULL(ptr[slot]);
+    memset(ptr[slot], (int)slot, size[slot]);
+  }
+  for (size_t i = 0; i < 32; i++) {
+    free(ptr[i]);
+  }
+}
+
+#ifdef TEST_THREADS
+#ifndef NTHREADS
+#define NTHREADS 8
+#endif
+#define NSLOTS 16
+
+typedef struct worker_result {
+  int ok;
+  unsigned char *ptr[NSLOTS];
+} worker_result;
+
+// Allocates and frees at random, checking that no other thread wrote to its
+// blocks. The blocks still live at the end are handed to the main thread.
+static void *malloc_worker(void *arg)
+{
+  uint32_t id = (uint32_t)(uintptr_t)arg;
+  uint32_t seed = id + 1;
+  worker_result *res = calloc(1, sizeof(worker_result));
+  if (res == NULL) {
+    return NULL;
+  }
+  size_t size[NSLOTS] = {0};
+  res->ok = 1;
+  for (size_t i = 0; i < 2e4; i++) {
+    seed = seed * 1103515245 + 12345;
+    size_t slot = (seed >> 16) % NSLOTS;
+    unsigned char tag = (unsigned char)(id * NSLOTS + slot);
+    if (res->ptr[slot] != NULL) {
+      for (size_t j = 0; j < size[slot]; j++) {
+        res->ok &= res->ptr[slot][j] == tag;
+      }
+      free(res->ptr[slot]);
+    }
+    seed = seed * 1103515245 + 12345;
+    size[slot] = 1 + (seed >> 16) % 2048;
+    res->ptr[slot] = malloc(size[slot]);
+    if (res->ptr[slot] == NULL) {
+      res->ok = 0;
+      break;
+    }
+    memset(res->ptr[slot], tag, size[slot]);
+  }
+  return res;
+}
+
+static void test_malloc_threads(void)
+{
+  // TEST_IGNORE();
+  pthread_t threads[NTHREADS];
+  for (size_t i = 0; i < NTHREADS; i++) {
+    TEST_ASSERT_EQUAL_INT(0, pthread_create(&threads[i], NULL, malloc_worker, (void *)i));
+  }
+  for (size_t i = 0; i < NTHREADS; i++) {
+    worker_result *res;
+    TEST_ASSERT_EQUAL_INT(0, pthread_join(threads[i], (void **)&res));
+    TEST_ASSERT_NOT_NULL(res);
+    TEST_ASSERT_TRUE(res->ok);
+    for (size_t j = 0; j < NSLOTS; j++) {
+      free(res->ptr[j]);
+    }
+    free(res);
+  }
+}
+
+static void *free_worker(void *arg)
+{
+  free(arg);
+  return NULL;
+}
+
+// Blocks freed by other threads must become available to the allocating
+// thread again; in total, far more is allocated than fits in memory at once.
+static void test_free_other_thread(void)
+{
+  // TEST_IGNORE();
+  for (size_t i = 0; i < 512; i++) {
+    char *ptr = malloc(1024*512);
+    TEST_ASSERT_NOT_NULL(ptr);
+    memset(ptr, 1, 1024*512);
+    pthread_t thread;
+    TEST_ASSERT_EQUAL_INT(0, pthread_create(&thread, NULL, free_worker, ptr));
+    TEST_ASSERT_EQUAL_INT(0, pthread_join(thread, NULL));
+  }
+}
+
+static void *cache_worker(void *arg)
+{
+  (void)arg;
+  void *ptr[64];
+  for (size_t i = 0; i < 64; i++) {
+    ptr[i] = malloc(480);
+  }
+  for (size_t i = 0; i < 64; i++) {
+    free(ptr[i]);
+  }
+  return NULL;
+}
+
+// The blocks left in a thread's cache go back to the heap when the thread
+// exits, or the heap would leak a full bin per thread.
+static void test_tcache_thread_exit(void)
+{
+  // TEST_IGNORE();
+#if defined(NO_TCACHE) || defined(TCACHE_PERCPU)
+  TEST_IGNORE_MESSAGE("no thread cache");
+#endif
+  pthread_t thread;
+  // The first thread makes libc allocate what it keeps for later threads.
+  TEST_ASSERT_EQUAL_INT(0, pthread_create(&thread, NULL, cache_worker, NULL));
+  TEST_ASSERT_EQUAL_INT(0, pthread_join(thread, NULL));
+  smalloc_heap_stats_t before, after;
+  smalloc_heap_stats(&before);
+  TEST_ASSERT_EQUAL_INT(0, pthread_create(&thread, NULL, cache_worker, NULL));
+  TEST_ASSERT_EQUAL_INT(0, pthread_join(thread, NULL));
+  smalloc_heap_stats(&after);
+  // A full bin of 480 byte blocks would be over 15 KiB.
+  TEST_ASSERT_TRUE(after.allocated <= before.allocated + 1024);
+}
+
+#ifndef BUDDY_LOCKFREE
+static int forking;
+
+static void *churn_worker(void *arg)
+{
+  (void)arg;
+  while (__atomic_load_n(&forking, __ATOMIC_RELAXED)) {
+    void *ptr[8];
+    for (size_t i = 0; i < 8; i++) {
+      ptr[i] = malloc(16 << i);
+    }
+    for (size_t i = 0; i < 8; i++) {
+      free(ptr[i]);
+    }
+  }
+  return NULL;
+}
+
+// A child forked while other threads allocate must find the heap usable.
+// Without the fork handlers it would hang on a lock held by a thread that
+// doesn't exist in the child.
+static void test_fork_threads(void)
+{
+  // TEST_IGNORE();
+  pthread_t threads[4];
+  __atomic_store_n(&forking, 1, __ATOMIC_RELAXED);
+  for (size_t i = 0; i < 4; i++) {
+    TEST_ASSERT_EQUAL_INT(0, pthread_create(&threads[i], NULL, churn_worker, NULL));
+  }
+  for (size_t i = 0; i < 64; i++) {
+    pid_t pid = fork();
+    TEST_ASSERT_TRUE(pid >= 0);
+    if (pid == 0) {
+      int ok = 1;
+      for (size_t j = 0; j < 256; j++) {
+        char *ptr = malloc(16 + j * 64);
+        ok &= ptr != NULL;
+        free(ptr);
+      }
+      _exit(ok ? 0 : 1);
+    }
+    int status;
+    TEST_ASSERT_EQUAL_INT(pid, waitpid(pid, &status, 0));
+    TEST_ASSERT_TRUE(WIFEXITED(status));
+    TEST_ASSERT_EQUAL_INT(0, WEXITSTATUS(status));
+  }
+  __atomic_store_n(&forking, 0, __ATOMIC_RELAXED);
+  for (size_t i = 0; i < 4; i++) {
+    TEST_ASSERT_EQUAL_INT(0, pthread_join(threads[i], NULL));
+  }
+}
+#endif
+#endif
+
+#ifndef BUDDY_LOCKFREE
+static uint64_t total_acquires(void)
+{
+  smalloc_lock_stats_t stats[64];
+  size_t n = smalloc_lock_stats(stats, 64);
+  uint64_t acquires = 0;
+  for (size_t i = 0; i < n && i < 64; i++) {
+    TEST_ASSERT_TRUE(stats[i].contended <= stats[i].acquires);
+    acquires += stats[i].acquires;
+  }
+  return acquires;
+}
+#endif
+
+static void test_lock_stats(void)
+{
+  // TEST_IGNORE();
+#ifdef BUDDY_LOCKFREE
+  TEST_ASSERT_EQUAL_UINT64(0, smalloc_lock_stats(NULL, 0));
+#else
+  uint64_t before = total_acquires();
+  // Too large for the thread cache, so it takes the lock.
+  void *ptr = malloc(1024*16);
+  TEST_ASSERT_NOT_NULL(ptr);
+  free(ptr);
+  TEST_ASSERT_TRUE(total_acquires() >= before + 2);
+#endif
+}
+
+static void test_heap_stats(void)
+{
+  // TEST_IGNORE();
+  smalloc_heap_stats_t before, during, after;
+  smalloc_heap_stats(&before);
+  // Too large for the thread cache, so free() gives it back to the heap.
+  void *ptr = malloc(1024*16);
+  TEST_ASSERT_NOT_NULL(ptr);
+  smalloc_heap_stats(&during);
+  free(ptr);
+  smalloc_heap_stats(&after);
+  TEST_ASSERT_TRUE(during.allocated >= before.allocated + 1024*16);
+  TEST_ASSERT_TRUE(during.footprint >= during.allocated);
+  TEST_ASSERT_EQUAL_UINT64(before.allocated, after.allocated);
+}
+
+static void test_info(void)
+{
+  // TEST_IGNORE();
+  // Too large for the thread cache, with a used block on either side of the
+  // one that is freed.
+  void *before = malloc(1024*16);
+  void *ptr = malloc(1024*16);
+  void *after = malloc(1024*16);
+  TEST_ASSERT_NOT_NULL(before);
+  TEST_ASSERT_NOT_NULL(ptr);
+  TEST_ASSERT_NOT_NULL(after);
+  free(ptr);
+  smalloc_info_t info;
+  smalloc_info(&info);
+  TEST_ASSERT_TRUE(info.largest_free >= 1024*16);
+  TEST_ASSERT_TRUE(info.free >= info.largest_free);
+  TEST_ASSERT_TRUE(info.footprint >= info.allocated + info.free + info.top);
+  uint64_t blocks = 0, bytes = 0;
+  for (size_t i = 0; i < info.nclasses; i++) {
+    blocks += info.classes[i].blocks;
+    bytes += info.classes[i].bytes;
+  }
+  TEST_ASSERT_EQUAL_UINT64(info.free_blocks, blocks);
+  TEST_ASSERT_EQUAL_UINT64(info.free, bytes);
+  TEST_ASSERT_TRUE(info.syscalls > 0);
+
+  struct mallinfo2 mi = mallinfo2();
+  TEST_ASSERT_EQUAL_UINT64(info.footprint, mi.arena);
+  TEST_ASSERT_EQUAL_UINT64(info.allocated, mi.uordblks);
+
+  FILE *fp = fopen("/dev/null", "w");
+  TEST_ASSERT_NOT_NULL(fp);
+  TEST_ASSERT_EQUAL_INT(0, malloc_info(0, fp));
+  TEST_ASSERT_EQUAL_INT(0, malloc_info(SMALLOC_INFO_JSON, fp));
+  TEST_ASSERT_EQUAL_INT(-1, malloc_info(2, fp));
+  TEST_ASSERT_EQUAL_INT(EINVAL, errno);
+  fclose(fp);
+  free(before);
+  free(after);
+}
+
+// Only buddy.c has a heap map.
+#pragma weak smalloc_heap_map
+
+static void test_heap_map(void)
+{
+  // TEST_IGNORE();
+  if (smalloc_heap_map == NULL) {
+    TEST_IGNORE_MESSAGE("no heap map");
+  }
+  void *before = malloc(1024*16);
+  void *ptr = malloc(1024*16);
+  void *after = malloc(1024*16);
+  TEST_ASSERT_NOT_NULL(before);
+  TEST_ASSERT_NOT_NULL(ptr);
+  TEST_ASSERT_NOT_NULL(after);
+  free(ptr);
+  FILE *fp = tmpfile();
+  TEST_ASSERT_NOT_NULL(fp);
+  TEST_ASSERT_EQUAL_INT(0, smalloc_heap_map(fileno(fp)));
+  rewind(fp);
+  char line[256];
+  TEST_ASSERT_NOT_NULL(fgets(line, sizeof(line), fp));
+  TEST_ASSERT_EQUAL_INT(0, strncmp(line, "heapmap ", 8));
+  size_t used = 0, free_starts = 0;
+  int c;
+  while ((c = fgetc(fp)) != EOF) {
+    used += c == '#';
+    free_starts += c == '|';
+  }
+  TEST_ASSERT_TRUE(used > 0);
+  TEST_ASSERT_TRUE(free_starts > 0);
+  fclose(fp);
+  free(before);
+  free(after);
+}
+
+// Freeing a large block may give its pages back to the OS, which must leave the
+// blocks around it alone.
+static void test_free_large_neighbours(void)
+{
+  // TEST_IGNORE();
+  for (size_t size = 1024*64; size <= 1024*1024; size *= 2) {
+    unsigned char *before = malloc(100);
+    unsigned char *large = malloc(size + 100);
+    unsigned char *after = malloc(100);
+    TEST_ASSERT_NOT_NULL(before);
+    TEST_ASSERT_NOT_NULL(large);
+    TEST_ASSERT_NOT_NULL(after);
+    memset(before, 1, 100);
+    memset(large, 2, size + 100);
+    memset(after, 3, 100);
+    free(large);
+    for (size_t i = 0; i < 100; i++) {
+      TEST_ASSERT_EQUAL_UINT8(1, before[i]);
+      TEST_ASSERT_EQUAL_UINT8(3, after[i]);
+    }
+    large = malloc(size);
+    TEST_ASSERT_NOT_NULL(large);
+    memset(large, 4, size);
+    free(large);
+    free(before);
+    free(after);
+  }
+}
+
+// Blocks of a batch must not overlap, and can be freed one by one as well as
+// in a batch.
+static void test_malloc_batch(void)
+{
+  // TEST_IGNORE();
+  static void *ptrs[4096];
+  size_t sizes[] = {1, 24, 100, 1000, 5000};
+  for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    size_t size = sizes[s];
+    size_t n = size > 1000 ? 256 : 4096;
+    TEST_ASSERT_EQUAL_UINT64(n, smalloc_batch(size, n, ptrs));
+    for (size_t i = 0; i < n; i++) {
+      memset(ptrs[i], (int)(i % 251), size);
+    }
+    for (size_t i = 0; i < n; i++) {
+      unsigned char *p = ptrs[i];
+      TEST_ASSERT_EQUAL_UINT8(i % 251, p[0]);
+      TEST_ASSERT_EQUAL_UINT8(i % 251, p[size - 1]);
+    }
+    for (size_t i = 0; i < n; i += 3) {
+      free(ptrs[i]);
+      ptrs[i] = NULL;
+    }
+    sfree_batch(ptrs, n);
+  }
+  TEST_ASSERT_EQUAL_UINT64(0, smalloc_batch(0, 16, ptrs));
+}
+
+// Freeing a run of blocks as one must not leave LL_NEXT_FIT's rover inside
+// the run. The blocks are too large for the thread cache.
+static void test_free_batch_rover(void)
+{
+  // TEST_IGNORE();
+  // The largest size below ll.c's large blocks, which no other free block is
+  // likely to fit.
+  static void *ptrs[200];
+  size_t size = 4000;
+  TEST_ASSERT_EQUAL_UINT64(200, smalloc_batch(size, 200, ptrs));
+  // The walk that finds the freed block again leaves the rover on it.
+  free(ptrs[100]);
+  ptrs[100] = malloc(size);
+  TEST_ASSERT_NOT_NULL(ptrs[100]);
+  sfree_batch(&ptrs[60], 90);
+  // Reuse the merged blocks, overwriting the headers that were in them, and
+  // leave a small free block behind so that the next walk is not skipped.
+  // Free blocks elsewhere that fit better are taken first.
+  size_t large_size = (char*)(ptrs[149]) - (char*)(ptrs[60]) + size - 512;
+  static unsigned char *large[64];
+  size_t n = 0;
+  while (n < 64) {
+    large[n] = malloc(large_size);
+    TEST_ASSERT_NOT_NULL(large[n]);
+    memset(large[n], 0xff, large_size);
+    if (large[n++] == ptrs[60]) {
+      break;
+    }
+  }
+  void *ptr = malloc(size);
+  TEST_ASSERT_NOT_NULL(ptr);
+  free(ptr);
+  for (size_t i = 0; i < n; i++) {
+    free(large[i]);
+  }
+  sfree_batch(ptrs, 60);
+  sfree_batch(&ptrs[150], 50);
+}
+
+// When something else moves the break, ll.c hands the tail of its last
+// segment out as a free block, and the old end of the heap is left with its
+// previous block free. Walks over the heap must still stop there.
+static void test_foreign_break(void)
+{
+  // TEST_IGNORE();
+  void *a = malloc(1000);
+  TEST_ASSERT_NOT_NULL(a);
+  TEST_ASSERT_TRUE(sbrk(4096) != (void*)-1);
+  void *b = malloc(100000);
+  void *r = malloc(1000);
+  void *s = malloc(1000);
+  void *t = malloc(1000);
+  TEST_ASSERT_NOT_NULL(b);
+  TEST_ASSERT_NOT_NULL(r);
+  TEST_ASSERT_NOT_NULL(s);
+  TEST_ASSERT_NOT_NULL(t);
+  free(s);
+  void *ptr = malloc(2000);
+  TEST_ASSERT_NOT_NULL(ptr);
+  free(ptr);
+  free(t);
+  free(r);
+  free(b);
+  free(a);
+}
+
+static void test_malloc_huge(void)
+{
+  // TEST_IGNORE();
+  // Volatile, so that the compiler doesn't reject the sizes up front.
+  volatile size_t sizes[] = {PTRDIFF_MAX, 0x7fffffffffffffe0, SIZE_MAX};
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    errno = 0;
+    TEST_ASSERT_NULL(malloc(sizes[i]));
+    TEST_ASSERT_EQUAL_INT(ENOMEM, errno);
+  }
+}
+
+#define STR(x) #x
+#define XSTR(x) STR(x)
+
+// LL_BEST_FIT takes the free block that fits tightest, wherever it is and
+// whenever it was freed. The sizes are too large for the thread cache, and
+// small enough for ll.c's per-size lists.
+static void test_best_fit_small(void)
+{
+  // TEST_IGNORE();
+#ifdef LL_POLICY
+  if (strcmp(XSTR(LL_POLICY), "LL_BEST_FIT") != 0) {
+    TEST_IGNORE_MESSAGE("not LL_BEST_FIT");
+  }
+#else
+  TEST_IGNORE_MESSAGE("not LL_BEST_FIT");
+#endif
+  // Used blocks in between keep the free ones from merging.
+  size_t sizes[] = {1000, 600, 800};
+  void *blocks[3];
+  void *guards[3];
+  for (size_t i = 0; i < 3; i++) {
+    blocks[i] = malloc(sizes[i]);
+    guards[i] = malloc(sizes[i]);
+    TEST_ASSERT_NOT_NULL(blocks[i]);
+    TEST_ASSERT_NOT_NULL(guards[i]);
+  }
+  // First fit by address would take the first block, and first fit on a
+  // LIFO list the last one freed.
+  volatile uintptr_t tightest = (uintptr_t)(blocks[1]);
+  free(blocks[1]);
+  free(blocks[2]);
+  free(blocks[0]);
+  void *ptr = malloc(600);
+  TEST_ASSERT_EQUAL_UINT64(tightest, (uintptr_t)(ptr));
+  free(ptr);
+  for (size_t i = 0; i < 3; i++) {
+    free(guards[i]);
+  }
+}
+
+// Out of line, the headers are in the side array, so blocks taken in one run
+// sit back to back, and a freed block of 64 KiB or more is purged: its pages
+// are given back to the OS at once, and none of them is touched again.
+static void test_oob(void)
+{
+  // TEST_IGNORE();
+#ifndef LL_OOB
+  TEST_IGNORE_MESSAGE("not LL_OOB");
+#else
+  static void *ptrs[256];
+  size_t n = sizeof(ptrs) / sizeof(ptrs[0]);
+  TEST_ASSERT_EQUAL_UINT64(n, smalloc_batch(64, n, ptrs));
+  size_t adjacent = 0;
+  for (size_t i = 1; i < n; i++) {
+    adjacent += (uintptr_t)(ptrs[i]) - (uintptr_t)(ptrs[i - 1]) == 64;
+  }
+  TEST_ASSERT_TRUE(adjacent >= n / 2);
+  sfree_batch(ptrs, n);
+
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  size_t size = 1024*1024;
+  char *ptr = malloc(size);
+  TEST_ASSERT_NOT_NULL(ptr);
+  memset(ptr, 1, size);
+  // The pages that lie wholly inside the block.
+  volatile uintptr_t start = ((uintptr_t)(ptr) + page - 1) & ~(uintptr_t)(page - 1);
+  size_t npages = ((uintptr_t)(ptr) + size - start) / page;
+  unsigned char vec[1024*1024 / 4096];
+  TEST_ASSERT_EQUAL_INT(0, mincore((void*)start, npages * page, vec));
+  TEST_ASSERT_EQUAL_UINT8(1, vec[0] & 1);
+  free(ptr);
+  TEST_ASSERT_EQUAL_INT(0, mincore((void*)start, npages * page, vec));
+  for (size_t i = 0; i < npages; i++) {
+    TEST_ASSERT_EQUAL_UINT8(0, vec[i] & 1);
+  }
+#endif
+}
+
+// Large free blocks are indexed by size, whatever the policy, so a large
+// request takes the smallest free block that fits rather than the first one
+// by address or the last one freed. A batch is carved out of a single run, so
+// the blocks are back to back, and the used ones keep the free ones apart.
+static void test_best_fit_large(void)
+{
+  // TEST_IGNORE();
+  if (smalloc_heap_map != NULL) {
+    TEST_IGNORE_MESSAGE("buddy.c has no best fit");
+  }
+  static void *ptrs[40];
+  size_t n = sizeof(ptrs) / sizeof(ptrs[0]);
+  TEST_ASSERT_EQUAL_UINT64(n, smalloc_batch(13360, n, ptrs));
+  // A free block of one, two and three blocks, the largest one first by
+  // address and last freed.
+  volatile uintptr_t tightest = (uintptr_t)(ptrs[20]);
+  free(ptrs[20]);
+  free(ptrs[10]);
+  free(ptrs[11]);
+  free(ptrs[1]);
+  free(ptrs[2]);
+  free(ptrs[3]);
+  ptrs[1] = ptrs[2] = ptrs[3] = ptrs[10] = ptrs[11] = NULL;
+  ptrs[20] = malloc(13360);
+  TEST_ASSERT_EQUAL_UINT64(tightest, (uintptr_t)(ptrs[20]));
+  sfree_batch(ptrs, n);
+}
+
 static void test_malloc_size_zero(void)
 {
   // TEST_IGNORE();
@@ -95,10 +666,32 @@ int main(void)
 {
   UnityBegin("buddy.c");
 
+  // First, while the heap is still a single segment with nothing free.
+  RUN_TEST(test_foreign_break);
   RUN_TEST(test_calloc_many);
+  RUN_TEST(test_free_large_neighbours);
+  RUN_TEST(test_heap_map);
+  RUN_TEST(test_heap_stats);
+  RUN_TEST(test_info);
+  RUN_TEST(test_lock_stats);
+  RUN_TEST(test_best_fit_small);
+  RUN_TEST(test_best_fit_large);
+  RUN_TEST(test_malloc_batch);
+  RUN_TEST(test_free_batch_rover);
+  RUN_TEST(test_oob);
   RUN_TEST(test_malloc_happy);
   RUN_TEST(test_malloc_many);
+  RUN_TEST(test_malloc_mixed_sizes);
+  RUN_TEST(test_malloc_huge);
   RUN_TEST(test_malloc_size_zero);
+#ifdef TEST_THREADS
+  RUN_TEST(test_malloc_threads);
+  RUN_TEST(test_free_other_thread);
+  RUN_TEST(test_tcache_thread_exit);
+#ifndef BUDDY_LOCKFREE
+  RUN_TEST(test_fork_threads);
+#endif
+#endif
   RUN_TEST(test_realloc_large);
   RUN_TEST(test_realloc_zero_size_free);
 
@@ -0,0 +1,375 @@
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#include "tcache.h"
+
+#ifdef TCACHE_PERCPU
+
+#if defined(__x86_64__) && defined(__has_include)
+#if __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#define PERCPU_HAVE_RSEQ
+#endif
+#endif
+
+#define PERCPU_CAP (TCACHE_MAX_COUNT)
+
+// The signature glibc registers rseq with, which must precede every abort
+// handler.
+#define PERCPU_RSEQ_SIG "0x53053053"
+
+enum {
+	PERCPU_UNINIT = 0,
+	PERCPU_RSEQ,
+	PERCPU_LOCK,
+	PERCPU_OFF,
+};
+
+enum {
+	PERCPU_OK = 0,
+	PERCPU_EMPTY,
+	PERCPU_FULL = PERCPU_EMPTY,
+	PERCPU_ABORT,
+	PERCPU_BYPASS,
+};
+
+// A bin is a stack of blocks. The layout is known to the rseq sequences:
+// count is at offset 0 and slot i at offset 8*(i+1).
+typedef struct percpu_bin_t {
+	size_t count;
+	void *slots[PERCPU_CAP];
+} percpu_bin_t;
+
+typedef struct percpu_cache_t {
+	percpu_bin_t bins[TCACHE_NBINS];
+	int lock;
+} __attribute__((aligned(64))) percpu_cache_t;
+
+// Reserved once for PERCPU_MAX_CPUS CPUs. Only the caches of CPUs that run
+// the allocator are ever touched, so memory grows with the cores in use.
+static percpu_cache_t *caches;
+static int mode = PERCPU_UNINIT;
+// One past the highest CPU whose cache was ever locked. Only raised under
+// init_lock, see fork_prepare().
+static int ncpus_seen = 0;
+static pthread_mutex_t init_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#ifdef PERCPU_HAVE_RSEQ
+static int
+rseq_cpu(void)
+{
+	struct rseq *rs = (struct rseq *)((char *)__builtin_thread_pointer() + __rseq_offset);
+	return (int)__atomic_load_n(&rs->cpu_id, __ATOMIC_RELAXED);
+}
+
+// Pops a block off the given bin of the current CPU in a restartable
+// sequence: if the thread is preempted or migrated before the count is
+// stored, the kernel moves it to the abort handler and nothing was changed.
+static int
+rseq_pop(size_t bin, void **ptr)
+{
+	char *base = (char *)&caches[0].bins[bin];
+	__asm__ goto (
+		".pushsection __rseq_cs, \"aw\"\n\t"
+		".balign 32\n\t"
+		"3:\n\t"
+		".long 0x0, 0x0\n\t"
+		".quad 1f, (2f - 1f), 4f\n\t"
+		".popsection\n\t"
+		"leaq 3b(%%rip), %%rax\n\t"
+		"movq %%rax, %%fs:8(%[rseq])\n\t"
+		"1:\n\t"
+		"movl %%fs:4(%[rseq]), %%eax\n\t"
+		"cmpl %[ncpu], %%eax\n\t"
+		"jae %l[bypass]\n\t"
+		"imulq %[stride], %%rax\n\t"
+		"addq %[base], %%rax\n\t"
+		"movq (%%rax), %%rcx\n\t"
+		"testq %%rcx, %%rcx\n\t"
+		"jz %l[empty]\n\t"
+		"movq (%%rax, %%rcx, 8), %%rdx\n\t"
+		"movq %%rdx, (%[ptr])\n\t"
+		"decq %%rcx\n\t"
+		"movq %%rcx, (%%rax)\n\t"
+		"2:\n\t"
+		".pushsection __rseq_failure, \"ax\"\n\t"
+		".byte 0x0f, 0xb9, 0x3d\n\t"
+		".long " PERCPU_RSEQ_SIG "\n\t"
+		"4:\n\t"
+		"jmp %l[abort]\n\t"
+		".popsection\n\t"
+		:
+		: [rseq] "r" (__rseq_offset), [ncpu] "i" (PERCPU_MAX_CPUS),
+		  [stride] "r" (sizeof(percpu_cache_t)), [base] "r" (base),
+		  [ptr] "r" (ptr)
+		: "rax", "rcx", "rdx", "memory", "cc"
+		: bypass, empty, abort);
+	return PERCPU_OK;
+bypass:
+	return PERCPU_BYPASS;
+empty:
+	return PERCPU_EMPTY;
+abort:
+	return PERCPU_ABORT;
+}
+
+// Pushes a block onto the given bin of the current CPU, see rseq_pop().
+static int
+rseq_push(size_t bin, void *ptr)
+{
+	char *base = (char *)&caches[0].bins[bin];
+	__asm__ goto (
+		".pushsection __rseq_cs, \"aw\"\n\t"
+		".balign 32\n\t"
+		"3:\n\t"
+		".long 0x0, 0x0\n\t"
+		".quad 1f, (2f - 1f), 4f\n\t"
+		".popsection\n\t"
+		"leaq 3b(%%rip), %%rax\n\t"
+		"movq %%rax, %%fs:8(%[rseq])\n\t"
+		"1:\n\t"
+		"movl %%fs:4(%[rseq]), %%eax\n\t"
+		"cmpl %[ncpu], %%eax\n\t"
+		"jae %l[bypass]\n\t"
+		"imulq %[stride], %%rax\n\t"
+		"addq %[base], %%rax\n\t"
+		"movq (%%rax), %%rcx\n\t"
+		"cmpq %[cap], %%rcx\n\t"
+		"jae %l[full]\n\t"
+		"movq %[ptr], 8(%%rax, %%rcx, 8)\n\t"
+		"incq %%rcx\n\t"
+		"movq %%rcx, (%%rax)\n\t"
+		"2:\n\t"
+		".pushsection __rseq_failure, \"ax\"\n\t"
+		".byte 0x0f, 0xb9, 0x3d\n\t"
+		".long " PERCPU_RSEQ_SIG "\n\t"
+		"4:\n\t"
+		"jmp %l[abort]\n\t"
+		".popsection\n\t"
+		:
+		: [rseq] "r" (__rseq_offset), [ncpu] "i" (PERCPU_MAX_CPUS),
+		  [stride] "r" (sizeof(percpu_cache_t)), [base] "r" (base),
+		  [cap] "i" (PERCPU_CAP), [ptr] "r" (ptr)
+		: "rax", "rcx", "rdx", "memory", "cc"
+		: bypass, full, abort);
+	return PERCPU_OK;
+bypass:
+	return PERCPU_BYPASS;
+full:
+	return PERCPU_FULL;
+abort:
+	return PERCPU_ABORT;
+}
+#endif
+
+// Picks rseq if glibc registered it for this thread, and sched_getcpu() with
+// a lock per CPU otherwise. All threads use the same mode, since the two
+// can't be mixed on one cache.
+static int
+percpu_init(void)
+{
+	int m = __atomic_load_n(&mode, __ATOMIC_ACQUIRE);
+	if (m != PERCPU_UNINIT) {
+		return m;
+	}
+	pthread_mutex_lock(&init_lock);
+	if (mode == PERCPU_UNINIT) {
+		m = PERCPU_LOCK;
+		void *mem = mmap(NULL, PERCPU_MAX_CPUS * sizeof(percpu_cache_t),
+			PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (mem == MAP_FAILED) {
+			m = PERCPU_OFF;
+		} else {
+			caches = mem;
+		}
+#ifdef PERCPU_HAVE_RSEQ
+		if (m == PERCPU_LOCK && __rseq_size > 0 && rseq_cpu() >= 0) {
+			m = PERCPU_RSEQ;
+		}
+#endif
+		__atomic_store_n(&mode, m, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&init_lock);
+	return mode;
+}
+
+// Returns the cache of the current CPU locked, or NULL if there is none.
+static percpu_cache_t*
+percpu_lock(void)
+{
+	int cpu = sched_getcpu();
+	if (cpu < 0 || cpu >= PERCPU_MAX_CPUS) {
+		return NULL;
+	}
+	if (cpu >= __atomic_load_n(&ncpus_seen, __ATOMIC_ACQUIRE)) {
+		pthread_mutex_lock(&init_lock);
+		if (cpu >= ncpus_seen) {
+			__atomic_store_n(&ncpus_seen, cpu + 1, __ATOMIC_RELEASE);
+		}
+		pthread_mutex_unlock(&init_lock);
+	}
+	percpu_cache_t *c = &caches[cpu];
+	// The holder is usually a thread preempted on the same CPU, so yield to
+	// it rather than spin for a whole time slice.
+	while (__atomic_exchange_n(&c->lock, 1, __ATOMIC_ACQUIRE)) {
+		sched_yield();
+	}
+	return c;
+}
+
+static void
+percpu_unlock(percpu_cache_t *c)
+{
+	__atomic_store_n(&c->lock, 0, __ATOMIC_RELEASE);
+}
+
+static int
+bin_pop(size_t bin, void **ptr)
+{
+	switch (percpu_init()) {
+#ifdef PERCPU_HAVE_RSEQ
+	case PERCPU_RSEQ:
+		for (;;) {
+			int r = rseq_pop(bin, ptr);
+			if (r != PERCPU_ABORT) {
+				return r;
+			}
+		}
+#endif
+	case PERCPU_LOCK: {
+		percpu_cache_t *c = percpu_lock();
+		if (c == NULL) {
+			return PERCPU_BYPASS;
+		}
+		percpu_bin_t *b = &c->bins[bin];
+		int r = PERCPU_EMPTY;
+		if (b->count > 0) {
+			*ptr = b->slots[--b->count];
+			r = PERCPU_OK;
+		}
+		percpu_unlock(c);
+		return r;
+	}
+	default:
+		return PERCPU_BYPASS;
+	}
+}
+
+static int
+bin_push(size_t bin, void *ptr)
+{
+	switch (percpu_init()) {
+#ifdef PERCPU_HAVE_RSEQ
+	case PERCPU_RSEQ:
+		for (;;) {
+			int r = rseq_push(bin, ptr);
+			if (r != PERCPU_ABORT) {
+				return r;
+			}
+		}
+#endif
+	case PERCPU_LOCK: {
+		percpu_cache_t *c = percpu_lock();
+		if (c == NULL) {
+			return PERCPU_BYPASS;
+		}
+		percpu_bin_t *b = &c->bins[bin];
+		int r = PERCPU_FULL;
+		if (b->count < PERCPU_CAP) {
+			b->slots[b->count++] = ptr;
+			r = PERCPU_OK;
+		}
+		percpu_unlock(c);
+		return r;
+	}
+	default:
+		return PERCPU_BYPASS;
+	}
+}
+
+void*
+tcache_malloc(size_t bin, size_t size)
+{
+	void *ptrs[TCACHE_BATCH];
+	int r = bin_pop(bin, &ptrs[0]);
+	if (r == PERCPU_OK) {
+		return ptrs[0];
+	}
+	if (r == PERCPU_BYPASS) {
+		return backend_malloc_batch(size, 1, ptrs) == 1 ? ptrs[0] : NULL;
+	}
+	// The thread may have moved to another CPU in the meantime, in which
+	// case that CPU's bin is refilled instead. Whatever doesn't fit goes
+	// back to the backend.
+	size_t n = backend_malloc_batch(size, TCACHE_BATCH, ptrs);
+	if (n == 0) {
+		return NULL;
+	}
+	size_t i = 1;
+	while (i < n && bin_push(bin, ptrs[i]) == PERCPU_OK) {
+		i++;
+	}
+	backend_free_batch(&ptrs[i], n - i);
+	return ptrs[0];
+}
+
+void
+tcache_free(size_t bin, void *ptr)
+{
+	void *ptrs[TCACHE_BATCH];
+	int r = bin_push(bin, ptr);
+	if (r == PERCPU_OK) {
+		return;
+	}
+	if (r == PERCPU_FULL) {
+		size_t n = 0;
+		while (n < TCACHE_BATCH && bin_pop(bin, &ptrs[n]) == PERCPU_OK) {
+			n++;
+		}
+		backend_free_batch(ptrs, n);
+		if (bin_push(bin, ptr) == PERCPU_OK) {
+			return;
+		}
+	}
+	backend_free_batch(&ptr, 1);
+}
+
+// In the lock mode, a thread of the parent may be halfway through a bin when
+// fork() is called, so the caches in use are locked around it. Holding
+// init_lock keeps other threads from starting on a new CPU's cache meanwhile.
+// The rseq sequences commit with their last store and need nothing.
+static void
+fork_prepare(void)
+{
+	pthread_mutex_lock(&init_lock);
+	if (mode != PERCPU_LOCK) {
+		return;
+	}
+	for (int i = 0; i < ncpus_seen; i++) {
+		while (__atomic_exchange_n(&caches[i].lock, 1, __ATOMIC_ACQUIRE)) {
+			sched_yield();
+		}
+	}
+}
+
+static void
+fork_release(void)
+{
+	if (mode == PERCPU_LOCK) {
+		for (int i = 0; i < ncpus_seen; i++) {
+			percpu_unlock(&caches[i]);
+		}
+	}
+	pthread_mutex_unlock(&init_lock);
+}
+
+__attribute__((constructor)) static void
+fork_handlers_init(void)
+{
+	pthread_atfork(fork_prepare, fork_release, fork_release);
+}
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef PROBE_H
+#define PROBE_H
+
+/*
+Static tracepoints (USDT probes) of the allocator, under the provider smalloc.
+
+With <sys/sdt.h> from SystemTap, a probe is a nop in the code, and a note in
+the ELF file tells tracers where it is and where to find its arguments. perf,
+bpftrace and SystemTap patch the nop into a breakpoint only while they are
+attached, so the probes can stay in production builds. Without the header, or
+built with -DNO_PROBES, the probes compile to nothing. make test-probes checks
+that ll.so and buddy.so have a note for every probe.
+
+  malloc(ptr, size)             malloc() returned ptr, NULL on failure, for
+                                a request of size bytes.
+  free(ptr)                     free() was called on ptr.
+  realloc_copy(old, new, size)  realloc() moved size bytes to a new block.
+  exhausted(size, arena)        no free block could hold a block of size
+                                bytes: buddy.c's arena ran out, or ll.c
+                                (arena 0) carves it from the top of the heap.
+  grow(addr, size)              the heap grew by size bytes at addr: by sbrk,
+                                or the side array's mmap, in ll.c, and by a
+                                new arena in buddy.c.
+
+bpftrace -e 'usdt:./ll.so:smalloc:malloc { @size = hist(arg1); }'
+*/
+
+#if !defined(NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define PROBES 1
+#endif
+#endif
+
+#ifdef PROBES
+#define PROBE1(name, a) DTRACE_PROBE1(smalloc, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(smalloc, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(smalloc, name, a, b, c)
+#else
+#define PROBE1(name, a) do { (void)(a); } while (0)
+#define PROBE2(name, a, b) do { (void)(a); (void)(b); } while (0)
+#define PROBE3(name, a, b, c) do { (void)(a); (void)(b); (void)(c); } while (0)
+#endif
+
+#endif
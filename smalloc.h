@@ -0,0 +1,98 @@
+#ifndef SMALLOC_H
+#define SMALLOC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+Extensions of the allocator, for either backend: batch allocation and
+statistics.
+*/
+
+// Allocates n blocks of size bytes each into ptrs, and returns how many were
+// allocated, which is less than n only when memory ran out. The blocks are
+// freed with free() or sfree_batch().
+size_t smalloc_batch(size_t size, size_t n, void **ptrs);
+
+// Frees the n blocks in ptrs, as free() does for each, skipping NULLs. The
+// order of ptrs is changed.
+void sfree_batch(void **ptrs, size_t n);
+
+typedef struct smalloc_lock_stats_t {
+	// Number of times the lock was taken.
+	uint64_t acquires;
+	// Number of those times that it was held by another thread.
+	uint64_t contended;
+	// Time spent in contended acquires, in nanoseconds.
+	uint64_t wait_ns;
+} smalloc_lock_stats_t;
+
+// Copies the statistics of up to n of the allocator's locks into stats, and
+// returns the number of locks. ll.c has a single lock. buddy.c has one per
+// arena, in arena order, up to the last arena in use.
+size_t smalloc_lock_stats(smalloc_lock_stats_t *stats, size_t n);
+
+typedef struct smalloc_heap_stats_t {
+	// Bytes of memory taken from the OS for blocks: the heap of ll.c, or the
+	// arenas in use of buddy.c.
+	uint64_t footprint;
+	// Bytes in allocated blocks, rounding and headers included. Blocks held
+	// by a thread or CPU cache count as allocated.
+	uint64_t allocated;
+} smalloc_heap_stats_t;
+
+// Fills in the current heap statistics. The counters are read without locks,
+// so they may be a few operations behind.
+void smalloc_heap_stats(smalloc_heap_stats_t *stats);
+
+#define SMALLOC_INFO_CLASSES (48)
+
+typedef struct smalloc_class_info_t {
+	// Free blocks of at least size bytes and less than twice that.
+	uint64_t size;
+	uint64_t blocks;
+	uint64_t bytes;
+} smalloc_class_info_t;
+
+typedef struct smalloc_info_t {
+	// As in smalloc_heap_stats_t.
+	uint64_t footprint;
+	uint64_t allocated;
+	// Bytes in free blocks, how many there are, and the largest.
+	uint64_t free;
+	uint64_t free_blocks;
+	uint64_t largest_free;
+	// Bytes at the end of the heap that are in no block yet.
+	uint64_t top;
+	// Bytes of headers, side arrays, spacetrees and order maps.
+	uint64_t metadata;
+	// Calls to sbrk(), mmap() and madvise() made by the allocator.
+	uint64_t syscalls;
+	// Free blocks by size class: by power of two for ll.c, and by order for
+	// buddy.c. Only the first nclasses are filled in.
+	size_t nclasses;
+	smalloc_class_info_t classes[SMALLOC_INFO_CLASSES];
+} smalloc_info_t;
+
+// Fills in a breakdown of the heap. Unlike smalloc_heap_stats(), this walks the
+// free blocks, under the allocator's locks. mallinfo2(), malloc_stats() and
+// malloc_info() report the same, and malloc_info() writes JSON rather than XML
+// when passed SMALLOC_INFO_JSON.
+void smalloc_info(smalloc_info_t *info);
+
+#define SMALLOC_INFO_JSON (1)
+
+// Writes a map of the heap to fd, for finding out why a request failed while
+// there was plenty of free space. Only buddy.c has one. Returns 0, or -1 if a
+// write failed.
+//
+// The map is text. A "heapmap min_size total_size" line is followed, for every
+// arena in use, by an "arena i" line, an "order k n" line with the number n
+// of free blocks of every order k, and the arena's min blocks, one char each
+// in lines of 128: '#' when allocated, '.' when free, and '|' for the first
+// min block of a free block. Free blocks next to each other that are not
+// buddies, and so can't be merged, are told apart by their '|'. bench-heapmap
+// renders a map as text or as an image.
+int smalloc_heap_map(int fd);
+
+#endif
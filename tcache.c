@@ -0,0 +1,93 @@
+#include <pthread.h>
+
+#include "tcache.h"
+
+#ifndef TCACHE_PERCPU
+
+__thread tcache_t tcache HIDDEN __attribute__((tls_model("initial-exec")));
+
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+
+static void
+tcache_destroy(void *arg)
+{
+	(void)arg;
+	void *ptrs[TCACHE_MAX_COUNT];
+	tcache.state = TCACHE_DESTROYED;
+	for (size_t i = 0; i < TCACHE_NBINS; i++) {
+		tcache_bin_t *b = &tcache.bins[i];
+		size_t n = 0;
+		for (; b->head != NULL; b->head = *(void**)(b->head)) {
+			ptrs[n++] = b->head;
+		}
+		b->count = 0;
+		backend_free_batch(ptrs, n);
+	}
+}
+
+static void
+tcache_key_create(void)
+{
+	pthread_key_create(&tcache_key, tcache_destroy);
+}
+
+// Sets up the cache of the calling thread. Returns 0 if the cache can't be
+// used, which is the case while it is being set up (pthread functions may
+// allocate) and after the thread's destructor ran.
+static int
+tcache_init(void)
+{
+	if (tcache.state != TCACHE_UNINIT) {
+		return tcache.state == TCACHE_ACTIVE;
+	}
+	tcache.state = TCACHE_INIT;
+	pthread_once(&tcache_once, tcache_key_create);
+	pthread_setspecific(tcache_key, &tcache);
+	tcache.state = TCACHE_ACTIVE;
+	return 1;
+}
+
+void*
+tcache_refill(size_t bin, size_t size)
+{
+	void *ptrs[TCACHE_BATCH];
+	if (!tcache_init()) {
+		return backend_malloc_batch(size, 1, ptrs) == 1 ? ptrs[0] : NULL;
+	}
+	size_t n = backend_malloc_batch(size, TCACHE_BATCH, ptrs);
+	if (n == 0) {
+		return NULL;
+	}
+	tcache_bin_t *b = &tcache.bins[bin];
+	for (size_t i = 1; i < n; i++) {
+		*(void**)(ptrs[i]) = b->head;
+		b->head = ptrs[i];
+		b->count++;
+	}
+	return ptrs[0];
+}
+
+void
+tcache_flush(size_t bin, void *ptr)
+{
+	if (!tcache_init()) {
+		backend_free_batch(&ptr, 1);
+		return;
+	}
+	tcache_bin_t *b = &tcache.bins[bin];
+	if (b->count >= TCACHE_MAX_COUNT) {
+		void *ptrs[TCACHE_BATCH];
+		for (size_t i = 0; i < TCACHE_BATCH; i++) {
+			ptrs[i] = b->head;
+			b->head = *(void**)(b->head);
+		}
+		b->count -= TCACHE_BATCH;
+		backend_free_batch(ptrs, TCACHE_BATCH);
+	}
+	*(void**)(ptr) = b->head;
+	b->head = ptr;
+	b->count++;
+}
+
+#endif
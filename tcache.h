@@ -0,0 +1,111 @@
+#ifndef TCACHE_H
+#define TCACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+Thread-local cache of free blocks, in front of either backend.
+
+Every thread keeps a LIFO list of free blocks per size class (bin). The backend
+decides what the bins are: a bin holds blocks of one exact size, and the
+backend maps sizes to bins. malloc() and free() of cached sizes only push and
+pop the thread's list, without locks and without touching the backend's
+structures. The next pointer of the list is kept in the first word of each
+cached block.
+
+An empty bin is refilled with TCACHE_BATCH blocks from the backend at once,
+and a bin holding TCACHE_MAX_COUNT blocks gives TCACHE_BATCH of them back at
+once, so the backend's lock is taken once per batch. When a thread exits, a
+TLS destructor gives all of its blocks back.
+
+The backend provides backend_malloc_batch() and backend_free_batch().
+
+Build with -DTCACHE_PERCPU (and percpu.c) to cache per CPU instead of per
+thread, so that cache memory grows with the number of cores rather than the
+number of threads. Each CPU keeps an array of up to TCACHE_MAX_COUNT blocks per
+bin. On x86-64 with a glibc that registers rseq, blocks are pushed and popped
+in restartable sequences: the CPU's bin is updated by plain loads and stores,
+and the kernel restarts the sequence if the thread is preempted or migrated
+before it commits. Otherwise the CPU is looked up with sched_getcpu() and its
+cache is protected by a spinlock. CPUs numbered PERCPU_MAX_CPUS or above go to
+the backend directly.
+*/
+
+#define TCACHE_NBINS (64)
+#define TCACHE_BATCH (16)
+#define TCACHE_MAX_COUNT (2*TCACHE_BATCH)
+
+#ifndef PERCPU_MAX_CPUS
+#define PERCPU_MAX_CPUS (256)
+#endif
+
+#define HIDDEN __attribute__((visibility("hidden")))
+
+// Allocates up to n blocks of size bytes into ptrs, returning how many were
+// allocated. Provided by the backend.
+HIDDEN size_t backend_malloc_batch(size_t size, size_t n, void **ptrs);
+
+// Frees the n blocks in ptrs. Provided by the backend.
+HIDDEN void backend_free_batch(void **ptrs, size_t n);
+
+#ifdef TCACHE_PERCPU
+
+// Returns a block of the given bin, which holds blocks of size bytes.
+HIDDEN void *tcache_malloc(size_t bin, size_t size);
+HIDDEN void tcache_free(size_t bin, void *ptr);
+
+#else
+
+enum {
+	TCACHE_UNINIT = 0,
+	TCACHE_INIT,
+	TCACHE_ACTIVE,
+	TCACHE_DESTROYED,
+};
+
+typedef struct tcache_bin_t {
+	void *head;
+	size_t count;
+} tcache_bin_t;
+
+typedef struct tcache_t {
+	tcache_bin_t bins[TCACHE_NBINS];
+	int state;
+} tcache_t;
+
+extern __thread tcache_t tcache HIDDEN __attribute__((tls_model("initial-exec")));
+
+HIDDEN void *tcache_refill(size_t bin, size_t size);
+HIDDEN void tcache_flush(size_t bin, void *ptr);
+
+// Returns a block of the given bin, which holds blocks of size bytes.
+static inline void*
+tcache_malloc(size_t bin, size_t size)
+{
+	tcache_bin_t *b = &tcache.bins[bin];
+	void *ptr = b->head;
+	if (ptr == NULL) {
+		return tcache_refill(bin, size);
+	}
+	b->head = *(void**)(ptr);
+	b->count--;
+	return ptr;
+}
+
+static inline void
+tcache_free(size_t bin, void *ptr)
+{
+	tcache_bin_t *b = &tcache.bins[bin];
+	if (tcache.state != TCACHE_ACTIVE || b->count >= TCACHE_MAX_COUNT) {
+		tcache_flush(bin, ptr);
+		return;
+	}
+	*(void**)(ptr) = b->head;
+	b->head = ptr;
+	b->count++;
+}
+
+#endif
+
+#endif